@@ -0,0 +1,33 @@
+/*
+	Userspace interface of the streaming haptics device.
+
+	Each controller gets a /dev/xpad360-haptics-<interface> node.
+	Writing an array of struct xpad360_haptics_frame queues the frames,
+	reading returns a struct xpad360_haptics_status.
+	Writes wait for room in the queue, or fail with EAGAIN on an O_NONBLOCK
+	file once it's full. poll reports POLLOUT when there's room.
+
+	Frame times are in microseconds from the start of the stream.
+	A stream starts with the first write while nothing is playing and ends
+	when the last queued frame has been played. Motors keep the magnitude
+	of the last frame, so end a stream with a zero frame.
+*/
+#pragma once
+
+#include <linux/types.h>
+
+struct xpad360_haptics_frame {
+	__u32 time_us;
+	__u16 strong;
+	__u16 weak;
+};
+
+struct xpad360_haptics_status {
+	__u64 stream_time_us; /* Current position in the stream, 0 if not playing */
+	__u32 queued; /* Frames waiting to be played */
+	__u32 played; /* Frames sent to the controller */
+	__u32 skipped; /* Frames replaced by a later one before they could be sent */
+	__u32 underruns; /* Streams that ran dry with the motors still on */
+	__u32 overruns; /* Frames rejected because the queue was full, O_NONBLOCK only */
+	__u32 playing;
+};
@@ -0,0 +1,617 @@
+#include "xpad360c.h"
+
+MODULE_AUTHOR("Zachary Lund <admin@computerquip.com>");
+MODULE_DESCRIPTION("Xbox 360 Controller Core");
+MODULE_LICENSE("GPL");
+
+static inline int xpad360c_check_urb(struct urb *urb)
+{
+	struct device *device = &urb->dev->dev;
+
+	switch (urb->status) {
+	case 0:
+		return true;
+	case -ECONNRESET:
+		dev_dbg(device, "Controller has been reset.\n");
+		break;
+	case -ESHUTDOWN:
+		dev_dbg(device, "Controller has shutdown.\n");
+		break;
+	case -ENOENT:
+		dev_dbg(device, "Controller has been poisoned.\n");
+		break;
+	default:
+		dev_dbg(device, "Unknown status returned by controller: %x\n", urb->status);
+	}
+
+	return false;
+}
+
+/* Once input is stopped the urb is poisoned anyway, this just keeps the log quiet. */
+static inline int xpad360c_submit_in(
+	struct xpad360_controller *controller,
+	struct urb *urb,
+	gfp_t mem_flags)
+{
+	if (unlikely(controller->stopped))
+		return -EPERM;
+
+	return usb_submit_urb(urb, mem_flags);
+}
+
+/*
+ * Called from the in urb completion whenever xpad360c_check_urb() fails.
+ * Transient bus errors are resubmitted right away, stalls are cleared from
+ * the recovery work with an exponential backoff, and if the errors keep
+ * coming the whole device is reset.
+ */
+static void xpad360c_recover_urb(struct xpad360_controller *controller, struct urb *urb)
+{
+	struct device *device = &urb->dev->dev;
+
+	switch (urb->status) {
+	case -ECONNRESET:
+	case -ESHUTDOWN:
+	case -ENOENT:
+	case -ENODEV:
+		/* Killed on purpose or gone for good. Nothing to recover. */
+		return;
+	}
+
+	if (controller->stopped)
+		return;
+
+	++controller->recoveries;
+
+	if (++controller->error_count > XPAD360C_MAX_URB_ERRORS) {
+		dev_warn(device, "Too many urb errors (last: %i), resetting device.\n", urb->status);
+		controller->error_count = 0;
+		usb_queue_reset_device(controller->interface);
+		return;
+	}
+
+	if (urb->status == -EPIPE) {
+		dev_dbg(device, "In endpoint stalled, clearing in %ums.\n", controller->stall_delay);
+
+		schedule_delayed_work(
+			&controller->recovery_work,
+			msecs_to_jiffies(controller->stall_delay)
+		);
+
+		controller->stall_delay =
+			min(controller->stall_delay * 2, (unsigned int)XPAD360C_STALL_DELAY_MAX);
+
+		return;
+	}
+
+	/* -EPROTO, -EILSEQ, -EOVERFLOW, -ETIME and friends. Usually just noise on the bus. */
+	if (unlikely(xpad360c_submit_in(controller, urb, GFP_ATOMIC) != 0))
+		dev_dbg(device, "usb_submit_urb() failed in recover_urb()!");
+}
+
+static void xpad360c_recovery_work(struct work_struct *work)
+{
+	struct xpad360_controller *controller =
+		container_of(to_delayed_work(work), struct xpad360_controller, recovery_work);
+	struct urb *urb = controller->in;
+	struct device *device = &urb->dev->dev;
+	int error = 0;
+
+	if (controller->stopped)
+		return;
+
+	error = usb_clear_halt(urb->dev, urb->pipe);
+	if (error) {
+		dev_dbg(device, "Failed to clear halt (%i), resetting device.\n", error);
+		usb_queue_reset_device(controller->interface);
+		return;
+	}
+
+	error = xpad360c_submit_in(controller, urb, GFP_KERNEL);
+	if (error)
+		dev_dbg(device, "usb_submit_urb() failed in recovery_work()!");
+}
+
+/* Use this instead of xpad360c_check_urb() in the in urb completion.
+   If it returns false, recovery has already been taken care of. */
+static inline int xpad360c_check_in_urb(struct xpad360_controller *controller, struct urb *urb)
+{
+	if (unlikely(!xpad360c_check_urb(urb))) {
+		xpad360c_recover_urb(controller, urb);
+		return false;
+	}
+
+	controller->error_count = 0;
+	controller->stall_delay = XPAD360C_STALL_DELAY_MIN;
+
+	if (unlikely(controller->resume_time)) {
+		controller->resume_latency_us =
+			ktime_us_delta(ktime_get(), controller->resume_time);
+		controller->resume_time = 0;
+
+		dev_dbg(&urb->dev->dev, "First report %lldus after resume.\n",
+			controller->resume_latency_us);
+	}
+
+	return true;
+}
+
+/* The one in urb completion shared by every transport. */
+static void xpad360c_receive(struct urb *urb)
+{
+	struct xpad360_controller *controller = urb->context;
+	struct device *device = &urb->dev->dev;
+	ktime_t timestamp = ktime_get(); /* As close to the device as we get */
+	unsigned long flags;
+
+	if (!xpad360c_check_in_urb(controller, urb))
+		return;
+
+	spin_lock_irqsave(&controller->decode_lock, flags);
+	controller->transport->decode(controller, urb->transfer_buffer, urb->actual_length, timestamp);
+	spin_unlock_irqrestore(&controller->decode_lock, flags);
+
+	if (unlikely(xpad360c_submit_in(controller, urb, GFP_ATOMIC) != 0))
+		dev_dbg(device, "usb_submit_urb() failed in receive()!");
+}
+
+/* Stops the in urb and any pending recovery. Used on disconnect and before reset.
+   Stopping twice is fine, poisoning nests so it's only done once. */
+void xpad360c_stop_input(struct xpad360_controller *controller)
+{
+	if (controller->stopped)
+		return;
+
+	controller->stopped = true;
+
+	/* Neither the completion nor the recovery work can resubmit a poisoned urb. */
+	usb_poison_urb(controller->in);
+	cancel_delayed_work_sync(&controller->recovery_work);
+}
+EXPORT_SYMBOL_GPL(xpad360c_stop_input);
+
+int xpad360c_start_input(struct xpad360_controller *controller)
+{
+	if (controller->stopped) {
+		usb_unpoison_urb(controller->in);
+		controller->stopped = false;
+	}
+
+	controller->error_count = 0;
+	controller->stall_delay = XPAD360C_STALL_DELAY_MIN;
+
+	return xpad360c_submit_in(controller, controller->in, GFP_KERNEL);
+}
+EXPORT_SYMBOL_GPL(xpad360c_start_input);
+
+/* Suspend and resume only take care of the urbs, including haptics and keepalives.
+   Anything else the device needs is up to the specific modules.
+   Transports that send from their own work must stop input and flush it first. */
+void xpad360c_suspend(struct xpad360_controller *controller)
+{
+	xpad360c_stop_input(controller);
+	xpad360c_haptics_suspend(controller);
+	xpad360c_keepalive_suspend(controller);
+	usb_kill_anchored_urbs(&controller->out_anchor);
+}
+EXPORT_SYMBOL_GPL(xpad360c_suspend);
+
+int xpad360c_resume(struct xpad360_controller *controller)
+{
+	controller->resume_time = ktime_get();
+
+	xpad360c_keepalive_resume(controller);
+	xpad360c_haptics_resume(controller);
+
+	return xpad360c_start_input(controller);
+}
+EXPORT_SYMBOL_GPL(xpad360c_resume);
+
+/* An open input device keeps the interface from autosuspending. */
+static int xpad360c_controller_open(struct input_dev* inputdev)
+{
+	struct xpad360_controller *controller = input_get_drvdata(inputdev);
+
+	return usb_autopm_get_interface(controller->interface);
+}
+
+static void xpad360c_controller_close(struct input_dev* inputdev)
+{
+	struct xpad360_controller *controller = input_get_drvdata(inputdev);
+
+	usb_autopm_put_interface(controller->interface);
+}
+
+/* The masks in xpad360c.h assume these share a bitmap word. */
+static_assert(BIT_WORD(BTN_A) == BIT_WORD(BTN_THUMBR));
+static_assert(BIT_WORD(ABS_X) == BIT_WORD(ABS_HAT0Y));
+static_assert(BIT_WORD(EV_KEY) == BIT_WORD(EV_FF));
+static_assert(BIT_WORD(BTN_TRIGGER_HAPPY1) == BIT_WORD(BTN_TRIGGER_HAPPY4));
+
+/* Applies a whole capability template at once. */
+static int xpad360c_input_capabilities(struct input_dev *inputdev, const struct xpad360c_caps *caps)
+{
+	unsigned int i = 0;
+
+	bitmap_copy(inputdev->evbit, caps->evbit, EV_CNT);
+	bitmap_copy(inputdev->keybit, caps->keybit, KEY_CNT);
+	bitmap_copy(inputdev->absbit, caps->absbit, ABS_CNT);
+	bitmap_copy(inputdev->mscbit, caps->mscbit, MSC_CNT);
+	bitmap_copy(inputdev->ffbit, caps->ffbit, FF_CNT);
+
+	input_alloc_absinfo(inputdev);
+	if (!inputdev->absinfo)
+		return -ENOMEM;
+
+	for (; i < caps->num_abs; ++i)
+		inputdev->absinfo[caps->abs[i].code] = caps->abs[i].info;
+
+	return 0;
+}
+
+/* The in urb completion may already be running, so the device is only returned.
+   Callers publish it in controller->inputdev once it's registered. */
+struct input_dev *xpad360c_allocate_inputdev(
+	struct xpad360_controller *controller,
+	struct usb_device *usbdev,
+	const char* name,
+	const char* path)
+{
+	struct input_dev * inputdev = devm_input_allocate_device(&usbdev->dev);
+
+	if (!inputdev) return NULL;
+
+	inputdev->name = name;
+	inputdev->phys = path;
+	inputdev->open = xpad360c_controller_open;
+	inputdev->close = xpad360c_controller_close;
+	input_set_drvdata(inputdev, controller);
+
+	if (xpad360c_input_capabilities(inputdev, controller->transport->caps)) {
+		input_free_device(inputdev);
+		return NULL;
+	}
+
+	usb_to_input_id(usbdev, &inputdev->id);
+
+	return inputdev;
+}
+EXPORT_SYMBOL_GPL(xpad360c_allocate_inputdev);
+
+void xpad360c_destroy_inputdev(struct xpad360_controller *controller)
+{
+	input_unregister_device(controller->inputdev);
+	controller->inputdev = NULL;
+}
+EXPORT_SYMBOL_GPL(xpad360c_destroy_inputdev);
+
+/*
+ * Starts a frame. Call it before reporting anything, the input core flushes
+ * early when a frame doesn't fit and that flush needs the timestamp too.
+ * timestamp is when the in urb completed, not when we got around to parsing it.
+ */
+void xpad360c_begin_frame(struct input_dev *inputdev, ktime_t timestamp)
+{
+	input_set_timestamp(inputdev, timestamp);
+}
+EXPORT_SYMBOL_GPL(xpad360c_begin_frame);
+
+/*
+ * This function is similar for all 360 controllers, only with different offsets.
+ * Anything uncommon is dealt with in specific modules.
+ * Each specific module has to deal with its own quirks.
+ *
+ * This ends the frame started by xpad360c_begin_frame().
+ * It reads XPAD360C_INPUT_LENGTH bytes from _data.
+ */
+void xpad360c_parse_input(struct input_dev *inputdev, void *_data, u32 sequence)
+{
+	u8 *data = _data;
+
+	/* start/back buttons */
+	input_report_key(inputdev, BTN_START,  data[0] & 0x10);
+	input_report_key(inputdev, BTN_SELECT, data[0] & 0x20); /* Back */
+
+	/* stick press left/right */
+	input_report_key(inputdev, BTN_THUMBL, data[0] & 0x40);
+	input_report_key(inputdev, BTN_THUMBR, data[0] & 0x80);
+
+	input_report_key(inputdev, BTN_TL,	data[1] & 0x01); /* Left Shoulder */
+	input_report_key(inputdev, BTN_TR,	data[1] & 0x02); /* Right Shoulder */
+	input_report_key(inputdev, BTN_MODE,	data[1] & 0x04); /* Guide */
+	/* data[8] & 0x08 is a dummy value */
+	input_report_key(inputdev, BTN_A,	data[1] & 0x10);
+	input_report_key(inputdev, BTN_B,	data[1] & 0x20);
+	input_report_key(inputdev, BTN_X,	data[1] & 0x40);
+	input_report_key(inputdev, BTN_Y,	data[1] & 0x80);
+
+	input_report_abs(inputdev, ABS_Z, data[2]);
+	input_report_abs(inputdev, ABS_RZ, data[3]);
+
+	/* Left Stick */
+	input_report_abs(inputdev, ABS_X, (s16)le16_to_cpup((__le16*)&data[4]));
+	input_report_abs(inputdev, ABS_Y, ~(s16)le16_to_cpup((__le16*)&data[6]));
+
+	/* Right Stick */
+	input_report_abs(inputdev, ABS_RX, (s16)le16_to_cpup((__le16*)&data[8]));
+	input_report_abs(inputdev, ABS_RY, ~(s16)le16_to_cpup((__le16*)&data[10]));
+
+	input_event(inputdev, EV_MSC, MSC_SERIAL, sequence);
+	input_sync(inputdev);
+}
+EXPORT_SYMBOL_GPL(xpad360c_parse_input);
+
+/* This allocates and initializes an urb specific for our needs. */
+struct urb* xpad360c_allocate_urb(
+	struct usb_device *usbdev,
+	int pipe,
+	void(*callback)(struct urb*),
+	gfp_t mem_flags)
+{
+	struct usb_host_endpoint *ep = usb_pipe_endpoint(usbdev, pipe);
+	struct urb *urb = usb_alloc_urb(0, mem_flags);
+
+	if (unlikely(!urb)) {
+		return NULL;
+	}
+
+	/* Allocate URB buffer */
+	urb->transfer_buffer =
+		usb_alloc_coherent(
+			usbdev,
+			ep->desc.wMaxPacketSize,
+			mem_flags,
+			&(urb->transfer_dma)
+		);
+
+	if (unlikely(!urb->transfer_buffer)) {
+		goto fail;
+	}
+
+	urb->dev = usbdev;
+	urb->pipe = pipe;
+	urb->transfer_buffer_length = ep->desc.wMaxPacketSize;
+	urb->complete = callback;
+	urb->interval = ep->desc.bInterval;
+	urb->start_frame = -1;
+	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+
+	return urb;
+
+fail:
+	usb_free_urb(urb);
+
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(xpad360c_allocate_urb);
+
+struct urb* xpad360c_copy_urb(struct urb *old_urb, gfp_t mem_flags)
+{
+	struct urb* urb =
+	xpad360c_allocate_urb(old_urb->dev, old_urb->pipe, old_urb->complete, mem_flags);
+
+	if (unlikely(!urb))
+		return NULL;
+
+	urb->context = old_urb->context;
+	return urb;
+}
+EXPORT_SYMBOL_GPL(xpad360c_copy_urb);
+
+void xpad360c_destroy_urb(struct urb *urb)
+{
+	struct usb_host_endpoint *ep = usb_pipe_endpoint(urb->dev, urb->pipe);
+
+	usb_free_coherent(
+		urb->dev,
+		ep->desc.wMaxPacketSize,
+		urb->transfer_buffer,
+		urb->transfer_dma
+	);
+
+	usb_free_urb(urb);
+}
+EXPORT_SYMBOL_GPL(xpad360c_destroy_urb);
+
+/*
+static void xpad360c_complete(struct urb* urb)
+{
+	xpad360c_check_urb(urb);
+}
+*/
+
+static void xpad360c_dangerous_complete(struct urb *urb)
+{
+	xpad360c_check_urb(urb);
+	usb_unanchor_urb(urb);
+	xpad360c_destroy_urb(urb);
+}
+
+/* Sends a copy of packet on a fresh urb which cleans itself up. */
+int xpad360c_send(struct xpad360_controller *controller, const void *packet, size_t length)
+{
+	struct urb *urb = xpad360c_copy_urb(controller->out, GFP_ATOMIC);
+	int error = 0;
+
+	if (unlikely(!urb))
+		return -ENOMEM;
+
+	memcpy(urb->transfer_buffer, packet, length);
+	urb->transfer_buffer_length = length;
+
+	usb_anchor_urb(urb, &controller->out_anchor);
+
+	error = usb_submit_urb(urb, GFP_ATOMIC);
+	if (unlikely(error)) {
+		dev_dbg(&urb->dev->dev, "usb_submit_urb() failed in send()!");
+		usb_unanchor_urb(urb);
+		xpad360c_destroy_urb(urb);
+	}
+
+	return error;
+}
+EXPORT_SYMBOL_GPL(xpad360c_send);
+
+int xpad360c_set_led(struct xpad360_controller *controller, u8 status)
+{
+	u8 packet[16];
+	size_t length = controller->transport->led(packet, status);
+
+	return xpad360c_send(controller, packet, length);
+}
+EXPORT_SYMBOL_GPL(xpad360c_set_led);
+
+int xpad360c_set_led_sync(struct xpad360_controller *controller, u8 status)
+{
+	struct usb_device *usbdev = controller->out->dev;
+	u8 *packet = kmalloc(16, GFP_KERNEL); /* usb_interrupt_msg() can't take the stack */
+	int error = 0;
+
+	if (!packet)
+		return -ENOMEM;
+
+	error =
+	usb_interrupt_msg(
+		usbdev, controller->out->pipe,
+		packet, controller->transport->led(packet, status), NULL, 0
+	);
+
+	if (error)
+		dev_dbg(&usbdev->dev, "synchronous set_led function failed!");
+
+	kfree(packet);
+	return error;
+}
+EXPORT_SYMBOL_GPL(xpad360c_set_led_sync);
+
+/* Memless force feedback callback. data must be the controller. */
+int xpad360c_rumble(struct input_dev *dev, void *data, struct ff_effect *effect)
+{
+	struct xpad360_controller *controller = data;
+	u8 packet[16];
+	size_t length;
+
+	if (effect->type != FF_RUMBLE)
+		return -EINVAL;
+
+	length =
+	controller->transport->rumble(
+		packet,
+		effect->u.rumble.strong_magnitude / 255,
+		effect->u.rumble.weak_magnitude / 255
+	);
+
+	return xpad360c_send(controller, packet, length);
+}
+EXPORT_SYMBOL_GPL(xpad360c_rumble);
+
+/* Callers must do the following:
+   	controller *must* be allocated.
+   	They must *not* allocate anything else within the xpad360_controller struct.
+	If the return value is not zero, they must free controller and disown the interface.
+
+   You must also register anything yourself. This, unfortunately, cannot be abstracted well.
+*/
+int xpad360c_probe(
+	struct xpad360_controller *controller,
+	struct usb_interface *interface,
+	const struct xpad360c_transport *transport)
+{
+	struct usb_device * usbdev = interface_to_usbdev(interface);
+	struct usb_endpoint_descriptor *ep_out = &(interface->cur_altsetting->endpoint[1].desc);
+	struct usb_endpoint_descriptor *ep_in = &(interface->cur_altsetting->endpoint[0].desc);
+	int error = -ENOMEM;
+
+	controller->interface = interface;
+	controller->transport = transport;
+	controller->stall_delay = XPAD360C_STALL_DELAY_MIN;
+
+	init_usb_anchor(&controller->out_anchor);
+	spin_lock_init(&controller->decode_lock);
+	INIT_DELAYED_WORK(&controller->recovery_work, xpad360c_recovery_work);
+	INIT_LIST_HEAD(&controller->keepalive_node);
+	xpad360c_chatpad_init(controller);
+
+	controller->adapter = xpad360c_adapter_get(usbdev);
+	if (unlikely(!controller->adapter)){
+		goto fail0;
+	}
+
+	/* Initialize common urbs */
+	controller->out =
+	xpad360c_allocate_urb(
+		usbdev,
+		usb_sndintpipe(usbdev, ep_out->bEndpointAddress),
+		xpad360c_dangerous_complete, GFP_KERNEL
+	);
+
+	if (unlikely(!controller->out)){
+		goto fail1;
+	}
+
+	controller->in =
+	xpad360c_allocate_urb(
+		usbdev,
+		usb_rcvintpipe(usbdev, ep_in->bEndpointAddress),
+		xpad360c_receive, GFP_KERNEL
+	);
+
+	if (unlikely(!controller->in)){
+		goto fail2;
+	}
+
+	controller->in->context = controller;
+	controller->out->context = controller;
+
+	error = xpad360c_start_input(controller);
+	if (unlikely(error)) {
+		goto fail3;
+	}
+
+	if (transport->query_presence)
+		transport->query_presence(controller);
+
+	goto success;
+
+fail3:
+	xpad360c_destroy_urb(controller->in);
+
+fail2:
+	xpad360c_destroy_urb(controller->out);
+
+fail1:
+	xpad360c_adapter_put(controller->adapter);
+
+fail0:
+success:
+	return error;
+}
+EXPORT_SYMBOL_GPL(xpad360c_probe);
+
+/* Callers must at least do the following:
+ 	They must *not* deallocate controller->in.
+ 	They must *not* deallocate controller->out.
+	They must call xpad360c_stop_input() first.
+	They must call xpad360c_chatpad_detach() first.
+ */
+void xpad360c_destroy(struct xpad360_controller *controller)
+{
+	xpad360c_destroy_urb(controller->in);
+	xpad360c_destroy_urb(controller->out);
+	xpad360c_adapter_put(controller->adapter);
+}
+EXPORT_SYMBOL_GPL(xpad360c_destroy);
+
+static int __init xpad360c_init(void)
+{
+	xpad360c_debugfs_create_root();
+	return 0;
+}
+
+static void __exit xpad360c_exit(void)
+{
+	xpad360c_debugfs_remove_root();
+}
+
+module_init(xpad360c_init);
+module_exit(xpad360c_exit);
@@ -3,21 +3,26 @@
 	Headsets
 
 	NOTES:
-	I'm forgetting the idea that the controller is HID compliant. 
-	While other drivers do use a filter driver for HID, we do not as it's inconvenient. 
+	I'm forgetting the idea that the controller is HID compliant.
+	While other drivers do use a filter driver for HID, we do not as it's inconvenient.
 	It doesn't make anything less painful, especially since Linux doesn't have a HID filter driver
-		and we'd have to provide our own HID descriptor. 
+		and we'd have to provide our own HID descriptor.
 
-	All allocation functions also initialize (which is always what we want). 
+	All allocation functions also initialize (which is always what we want).
+
+	Everything declared here lives in the xpad360_core module (xpad360c.c).
+	The wired and wireless modules only provide a transport for it.
 */
 #pragma once
 
+#include <linux/mutex.h>
 #include <linux/spinlock.h>
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/slab.h>
+#include <linux/workqueue.h>
 #include <linux/usb/input.h>
-	
+
 enum xpad360c_led_t{
 	XPAD360_LED_OFF,
 	XPAD360_LED_ALL_BLINKING,
@@ -35,331 +40,232 @@ enum xpad360c_led_t{
 	XPAD360_LED_ALTERNATING
 };
 
-struct packet_work {
-	struct work_struct work;
-	struct urb *urb;
-	struct input_dev *inputdev;
+/* Consecutive in urb failures tolerated before the device is reset. */
+#define XPAD360C_MAX_URB_ERRORS 8
+
+/* Bounds of the backoff used to clear a stalled in endpoint, in ms. */
+#define XPAD360C_STALL_DELAY_MIN 1
+#define XPAD360C_STALL_DELAY_MAX 32
+
+/* Bytes read by xpad360c_parse_input(). Transports must check for them. */
+#define XPAD360C_INPUT_LENGTH 12
+
+/*
+ * Input capabilities are described by constant templates, one per transport,
+ * and applied in one go when the input device is allocated.
+ * Transports build theirs from the masks below so they can't drift apart.
+ * Each mask lives in a single bitmap word, see the static_asserts in xpad360c.c.
+ */
+struct xpad360c_absinfo {
+	unsigned int code;
+	struct input_absinfo info;
+};
+
+struct xpad360c_caps {
+	unsigned long evbit[BITS_TO_LONGS(EV_CNT)];
+	unsigned long keybit[BITS_TO_LONGS(KEY_CNT)];
+	unsigned long absbit[BITS_TO_LONGS(ABS_CNT)];
+	unsigned long mscbit[BITS_TO_LONGS(MSC_CNT)];
+	unsigned long ffbit[BITS_TO_LONGS(FF_CNT)];
+
+	const struct xpad360c_absinfo *abs;
+	unsigned int num_abs;
+};
+
+#define XPAD360C_EV_MASK \
+	(BIT_MASK(EV_KEY) | BIT_MASK(EV_ABS) | BIT_MASK(EV_MSC) | BIT_MASK(EV_FF))
+
+/* Buttons */
+#define XPAD360C_KEY_WORD BIT_WORD(BTN_A)
+#define XPAD360C_KEY_MASK \
+	(BIT_MASK(BTN_A) | BIT_MASK(BTN_B) | BIT_MASK(BTN_X) | BIT_MASK(BTN_Y) | \
+	 BIT_MASK(BTN_START) | BIT_MASK(BTN_SELECT) | BIT_MASK(BTN_MODE) | \
+	 BIT_MASK(BTN_THUMBL) | BIT_MASK(BTN_THUMBR) | BIT_MASK(BTN_TL) | BIT_MASK(BTN_TR))
+
+/* Sticks and triggers */
+#define XPAD360C_ABS_WORD BIT_WORD(ABS_X)
+#define XPAD360C_ABS_MASK \
+	(BIT_MASK(ABS_X) | BIT_MASK(ABS_Y) | BIT_MASK(ABS_RX) | BIT_MASK(ABS_RY) | \
+	 BIT_MASK(ABS_Z) | BIT_MASK(ABS_RZ))
+
+#define XPAD360C_STICK(code) \
+	{ code, { .minimum = -32768, .maximum = 32767, .fuzz = 16, .flat = 128 } }
+#define XPAD360C_TRIGGER(code) \
+	{ code, { .minimum = 0, .maximum = 255 } }
+
+#define XPAD360C_ABSINFO \
+	XPAD360C_STICK(ABS_X), XPAD360C_STICK(ABS_Y), \
+	XPAD360C_STICK(ABS_RX), XPAD360C_STICK(ABS_RY), \
+	XPAD360C_TRIGGER(ABS_Z), XPAD360C_TRIGGER(ABS_RZ)
+
+/* Report sequence number and force feedback */
+#define XPAD360C_MSC_MASK BIT_MASK(MSC_SERIAL)
+#define XPAD360C_FF_WORD BIT_WORD(FF_RUMBLE)
+#define XPAD360C_FF_MASK BIT_MASK(FF_RUMBLE)
+
+struct dentry;
+struct xpad360_controller;
+struct xpad360c_adapter;
+struct xpad360c_chatpad;
+struct xpad360c_haptics;
+
+/*
+ * What makes a wired controller different from a wireless one.
+ * The core owns the urbs, the input device and the force feedback,
+ * and calls into the transport for anything that depends on the wire format.
+ */
+struct xpad360c_transport {
+	/* Capabilities of the input device. */
+	const struct xpad360c_caps *caps;
+
+	/* Dispatches a packet received on the in endpoint at timestamp.
+	   Called from the in urb completion or debugfs with the decode lock held,
+	   so it must not sleep. */
+	void (*decode)(struct xpad360_controller *controller, u8 *data, size_t length, ktime_t timestamp);
+
+	/* Write an out packet into buffer and return its length. */
+	size_t (*rumble)(void *buffer, u8 strong, u8 weak);
+	size_t (*led)(void *buffer, u8 status);
+
+	/* Optional. Keepalive for attachments, tick 0 is the first one after attaching.
+	   Without it, attachments that need one aren't supported. */
+	size_t (*keepalive)(void *buffer, unsigned int tick);
+
+	/* Optional. Asks the device which controllers are connected. */
+	void (*query_presence)(struct xpad360_controller *controller);
+
+	/* Optional. Adds transport specific files to the controller's debugfs directory. */
+	void (*debugfs)(struct xpad360_controller *controller, struct dentry *dir);
+};
+
+/* Packet injection through debugfs, see xpad360c_debugfs.c */
+struct xpad360c_inject {
+	u32 rate; /* Packets per second, 0 for as fast as possible */
+	u64 total_packets;
+	u64 last_packets;
+	u64 last_ns;
+	u64 last_max_ns; /* Slowest decode of the last batch */
+	u64 max_ns; /* Slowest decode ever injected */
 };
 
-/* Our main structure. 
-   Only oddball here is the out urb. 
-   It's implicitly readonly after initialization. 
+/* Our main structure.
+   Only oddball here is the out urb.
+   It's implicitly readonly after initialization.
  */
 struct xpad360_controller {
 
 	struct input_dev *inputdev;
 
+	struct usb_interface *interface;
+	const struct xpad360c_transport *transport;
+
 	struct urb *in;
 
 	struct urb *out;
 	struct usb_anchor out_anchor;
 
+	/* Streaming haptics device, see xpad360c_haptics.c */
+	struct xpad360c_haptics *haptics;
+
+	/* Chatpad and its keepalive, see xpad360c_chatpad.c and xpad360c_adapter.c.
+	   The keepalive fields belong to the adapter and are protected by its mutex. */
+	struct xpad360c_chatpad *chatpad;
+	struct mutex chatpad_mutex; /* Protects chatpad */
+	struct work_struct chatpad_work; /* Detaches a chatpad that stopped answering */
+	struct xpad360c_adapter *adapter;
+	struct list_head keepalive_node;
+	struct urb *keepalive_urb;
+	unsigned int keepalive_tick;
+	unsigned long keepalive_ack; /* jiffies of the last sign of life from the attachment */
+	bool keepalive_busy;
+
+	struct dentry *debugfs;
+	struct xpad360c_inject inject;
+	spinlock_t decode_lock; /* Injected packets and the in urb take turns decoding */
+
+	/* In urb error recovery. See xpad360c_recover_urb().
+	   Only touched from the in urb completion and the recovery work,
+	   which never run at the same time. */
+	struct delayed_work recovery_work;
+	unsigned int error_count; /* Consecutive failures */
+	unsigned int stall_delay; /* Next clear halt delay in ms */
+	unsigned int recoveries; /* Total recoveries attempted */
+	bool stopped;
+
+	/* Input reports received so far. Transports assign it when the 
+	   report arrives, so dropped reports show up as gaps in MSC_SERIAL. */
+	u32 sequence;
+
+	/* Set on resume, cleared by the first report after it. */
+	ktime_t resume_time;
+	s64 resume_latency_us;
+
 	char path[64];
 };
 
-static inline int xpad360c_check_urb(struct urb *urb)
-{
-	struct device *device = &urb->dev->dev;
-	
-	switch (urb->status) { 
-	case 0: 
-		return true;
-	case -ECONNRESET: 
-		dev_dbg(device, "Controller has been reset.\n");
-		break; 
-	case -ESHUTDOWN: 
-		dev_dbg(device, "Controller has shutdown.\n"); 
-		break; 
-	case -ENOENT: 
-		dev_dbg(device, "Controller has been poisoned.\n"); 
-		break; 
-	default: 
-		dev_dbg(device, "Unknown status returned by controller: %x\n", urb->status);  
-	}
-	
-	return false;
-}
-
-static int xpad360c_controller_open(struct input_dev* inputdev)
-{ return 0; }
-
-static void xpad360c_controller_close(struct input_dev* inputdev)
-{}
-
-static void xpad360c_input_capabilities(struct input_dev *inputdev) 
-{
-	/* TODO: Fix this ugly mess. Send all data at once. 
-	   That would be cleaner and much more efficient.  */
-#define SET_BIT(type) __set_bit(type, inputdev->keybit);
-
-	/* Buttons */
-	__set_bit(EV_KEY, inputdev->evbit);
-	SET_BIT(BTN_A);
-	SET_BIT(BTN_B);
-	SET_BIT(BTN_X);
-	SET_BIT(BTN_Y);
-	SET_BIT(BTN_START);
-	SET_BIT(BTN_SELECT);
-	SET_BIT(BTN_THUMBL);
-	SET_BIT(BTN_THUMBR);
-	SET_BIT(BTN_TL);
-	SET_BIT(BTN_TR);
-	SET_BIT(BTN_MODE);
-
-#undef SET_BIT
-#define SET_BIT(type) \
-	__set_bit(type, inputdev->absbit);\
-	input_set_abs_params(inputdev, type, -32768, 32767, 16, 128);
-
-	/* Axis (Sticks)*/
-	__set_bit(EV_ABS, inputdev->evbit);
-	SET_BIT(ABS_X);
-	SET_BIT(ABS_Y);
-	SET_BIT(ABS_RX);
-	SET_BIT(ABS_RY);
-
-#undef SET_BIT
-#define SET_BIT(type) \
-	__set_bit(type, inputdev->absbit); \
-	input_set_abs_params(inputdev, type, 0, 255, 0, 0);
-
-	/* Triggers */
-	SET_BIT(ABS_Z);
-	SET_BIT(ABS_RZ);
-
-#undef SET_BIT
-
-	/* Force Feedback */
-	__set_bit(EV_FF, inputdev->evbit);
-	__set_bit(FF_RUMBLE, inputdev->ffbit);
-}
-
-void xpad360c_allocate_inputdev(
-	struct xpad360_controller *controller,
-	struct usb_device *usbdev,
-	const char* name,
-	const char* path)
-{
-	struct input_dev * inputdev;
-	
-	if (controller->inputdev)
-		return;
-	
-	inputdev = devm_input_allocate_device(&usbdev->dev);
-
-	if (!inputdev) return;
-
-	inputdev->name = name;
-	inputdev->phys = path;
-	inputdev->open = xpad360c_controller_open;
-	inputdev->close = xpad360c_controller_close;
-
-	xpad360c_input_capabilities(inputdev);
-	usb_to_input_id(usbdev, &inputdev->id);
-
-	controller->inputdev = inputdev;
-}
-
-void xpad360c_destroy_inputdev(struct xpad360_controller *controller)
-{
-	input_unregister_device(controller->inputdev);
-	controller->inputdev = NULL;
-}
-
-/* 
- * This function is similar for all 360 controllers, only with different offsets. 
- * Anything uncommon is dealt with in specific modules.
- * Each specific module has to deal with its own quirks. 
- */
-void xpad360c_parse_input(struct input_dev *inputdev, void *_data) 
-{
-	u8 *data = _data;
-
-	/* start/back buttons */
-	input_report_key(inputdev, BTN_START,  data[0] & 0x10);
-	input_report_key(inputdev, BTN_SELECT, data[0] & 0x20); /* Back */
-
-	/* stick press left/right */
-	input_report_key(inputdev, BTN_THUMBL, data[0] & 0x40);
-	input_report_key(inputdev, BTN_THUMBR, data[0] & 0x80);
-
-	input_report_key(inputdev, BTN_TL,	data[1] & 0x01); /* Left Shoulder */
-	input_report_key(inputdev, BTN_TR,	data[1] & 0x02); /* Right Shoulder */
-	input_report_key(inputdev, BTN_MODE,	data[1] & 0x04); /* Guide */
-	/* data[8] & 0x08 is a dummy value */
-	input_report_key(inputdev, BTN_A,	data[1] & 0x10);
-	input_report_key(inputdev, BTN_B,	data[1] & 0x20);
-	input_report_key(inputdev, BTN_X,	data[1] & 0x40);
-	input_report_key(inputdev, BTN_Y,	data[1] & 0x80);
-
-	input_report_abs(inputdev, ABS_Z, data[2]);
-	input_report_abs(inputdev, ABS_RZ, data[3]);
-
-	/* Left Stick */
-	input_report_abs(inputdev, ABS_X, (s16)le16_to_cpup((__le16*)&data[4]));
-	input_report_abs(inputdev, ABS_Y, ~(s16)le16_to_cpup((__le16*)&data[6]));
-
-	/* Right Stick */
-	input_report_abs(inputdev, ABS_RX, (s16)le16_to_cpup((__le16*)&data[8]));
-	input_report_abs(inputdev, ABS_RY, ~(s16)le16_to_cpup((__le16*)&data[10]));
-	
-	input_sync(inputdev);
-}
-
-/* This allocates and initializes an urb specific for our needs. */
+/* Urbs */
 struct urb* xpad360c_allocate_urb(
 	struct usb_device *usbdev,
-	int pipe, /* We can construct an endpoint from a pipe... but not the other way around. */ 
+	int pipe, /* We can construct an endpoint from a pipe... but not the other way around. */
 	void(*callback)(struct urb*),
-	gfp_t mem_flags)
-{
-	struct usb_host_endpoint *ep = usb_pipe_endpoint(usbdev, pipe);
-	struct urb *urb = usb_alloc_urb(0, mem_flags);
-
-	if (unlikely(!urb)) {
-		return NULL;
-	}
-
-	/* Allocate URB buffer */
-	urb->transfer_buffer =
-		usb_alloc_coherent(
-			usbdev,
-			ep->desc.wMaxPacketSize,
-			mem_flags,
-			&(urb->transfer_dma)
-		);
-		
-	if (unlikely(!urb->transfer_buffer)) {
-		goto fail;
-	}
-	
-	urb->dev = usbdev;
-	urb->pipe = pipe;
-	urb->transfer_buffer_length = ep->desc.wMaxPacketSize;
-	urb->complete = callback;
-	urb->interval = ep->desc.bInterval;
-	urb->start_frame = -1;
-	urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
-
-	return urb;
-
-fail:
-	usb_free_urb(urb);
-	
-	return NULL;
-}
-
-static inline 
-struct urb* xpad360c_copy_urb(struct urb *old_urb, gfp_t mem_flags)
-{
-	struct urb* urb =
-	xpad360c_allocate_urb(old_urb->dev, old_urb->pipe, old_urb->complete, mem_flags);
-
-	urb->context = old_urb->context;
-	return urb;
-}
-
-void xpad360c_destroy_urb(struct urb *urb)
-{
-	struct usb_host_endpoint *ep = usb_pipe_endpoint(urb->dev, urb->pipe);
-
-	usb_free_coherent(
-		urb->dev,
-		ep->desc.wMaxPacketSize,
-		urb->transfer_buffer,
-		urb->transfer_dma
-	);
-
-	usb_free_urb(urb);
-}
-
-/*
-static void xpad360c_complete(struct urb* urb)
-{
-	xpad360c_check_urb(urb);
-}
-*/
-
-static void xpad360c_dangerous_complete(struct urb *urb)
-{
-	xpad360c_check_urb(urb);
-	usb_unanchor_urb(urb);
-	xpad360c_destroy_urb(urb);
-}
+	gfp_t mem_flags);
+struct urb* xpad360c_copy_urb(struct urb *old_urb, gfp_t mem_flags);
+void xpad360c_destroy_urb(struct urb *urb);
 
-/* Callers must do the following:
-   	controller *must* be allocated. 
-   	They *must* set controller->in->complete themselves.
-   	They must *not* allocate anything else within the xpad360_controller struct.
-	If the return value is not zero, they must disown the interface.
+/* Out packets. These are safe to call from atomic context. */
+int xpad360c_send(struct xpad360_controller *controller, const void *packet, size_t length);
+int xpad360c_set_led(struct xpad360_controller *controller, u8 status);
+int xpad360c_set_led_sync(struct xpad360_controller *controller, u8 status); /* Sleeps */
 
-   You must also register anything yourself. This, unfortunately, cannot be abstracted well. 
-*/
+/* Input */
+struct input_dev *xpad360c_allocate_inputdev(
+	struct xpad360_controller *controller,
+	struct usb_device *usbdev,
+	const char* name,
+	const char* path);
+void xpad360c_destroy_inputdev(struct xpad360_controller *controller);
+void xpad360c_begin_frame(struct input_dev *inputdev, ktime_t timestamp);
+void xpad360c_parse_input(struct input_dev *inputdev, void *_data, u32 sequence);
+int xpad360c_rumble(struct input_dev *dev, void *data, struct ff_effect *effect);
+
+/* Streaming haptics. Create it once the controller can take rumble packets. */
+int xpad360c_haptics_init(struct xpad360_controller *controller);
+void xpad360c_haptics_destroy(struct xpad360_controller *controller);
+void xpad360c_haptics_suspend(struct xpad360_controller *controller); /* Core module only */
+void xpad360c_haptics_resume(struct xpad360_controller *controller); /* Core module only */
+
+/* Chatpad. These sleep. It's also detached when it stops acknowledging keepalives. */
+int xpad360c_chatpad_attach(struct xpad360_controller *controller);
+void xpad360c_chatpad_detach(struct xpad360_controller *controller);
+void xpad360c_chatpad_report(struct xpad360_controller *controller, const u8 *data); /* 3 bytes */
+void xpad360c_chatpad_init(struct xpad360_controller *controller); /* Core module only */
+
+/* Adapter wide keepalive timer. Sleeps, except for ack, which transports call
+   from the completion whenever the attachment shows signs of life. */
+int xpad360c_keepalive_start(struct xpad360_controller *controller);
+void xpad360c_keepalive_stop(struct xpad360_controller *controller);
+void xpad360c_keepalive_ack(struct xpad360_controller *controller);
+void xpad360c_keepalive_suspend(struct xpad360_controller *controller); /* Core module only */
+void xpad360c_keepalive_resume(struct xpad360_controller *controller); /* Core module only */
+struct xpad360c_adapter *xpad360c_adapter_get(struct usb_device *usbdev); /* Core module only */
+void xpad360c_adapter_put(struct xpad360c_adapter *adapter); /* Core module only */
+
+/* debugfs. Injected packets go straight to the decoder, so remove it right after
+   stopping input and before tearing down anything the decoder uses.
+   Writers give up once input is stopped. */
+void xpad360c_debugfs_init(struct xpad360_controller *controller);
+void xpad360c_debugfs_destroy(struct xpad360_controller *controller);
+void xpad360c_debugfs_create_root(void); /* Core module only */
+void xpad360c_debugfs_remove_root(void); /* Core module only */
+
+/* Lifetime */
 int xpad360c_probe(
-	struct xpad360_controller *controller, 
+	struct xpad360_controller *controller,
 	struct usb_interface *interface,
-	void (*on_receive)(struct urb* urb),
-	void (*on_send)(struct urb* urb))
-{
-	struct usb_device * usbdev = interface_to_usbdev(interface);
-	struct usb_endpoint_descriptor *ep_out = &(interface->cur_altsetting->endpoint[1].desc);
-	struct usb_endpoint_descriptor *ep_in = &(interface->cur_altsetting->endpoint[0].desc);
-	int error = 0;
-
-	init_usb_anchor(&controller->out_anchor);
-
-	/* Initialize common urbs */
-	controller->out = 
-	xpad360c_allocate_urb(
-		usbdev,
-		usb_sndintpipe(usbdev, ep_out->bEndpointAddress),
-		on_send, GFP_KERNEL
-	);
-	
-	if (unlikely(!controller->out)){
-		goto fail0;
-	}
-
-	controller->in = 
-	xpad360c_allocate_urb(
-		usbdev,
-		usb_rcvintpipe(usbdev, ep_in->bEndpointAddress),
-		on_receive, GFP_KERNEL
-	);
-		
-	if (unlikely(!controller->in)){
-		goto fail1;
-	}
-
-	controller->in->context = controller;
-	controller->out->context = controller;
-
-	error = usb_submit_urb(controller->in, GFP_KERNEL);
-	if (unlikely(error)) {
-		goto fail2;
-	}
-
-	goto success;
-
-fail2:
-	xpad360c_destroy_urb(controller->in);
-
-fail1:
-	xpad360c_destroy_urb(controller->out);
-
-fail0:
-	kfree(controller);
-
-success:
-	return error;
-}
-
-/* Callers must at least do the following:
- 	They must *not* deallocate controller->in. 
- 	They must *not* deallocate controller->out. 
- */
-void xpad360c_destroy(struct xpad360_controller *controller)
-{
-	xpad360c_destroy_urb(controller->in);
-	xpad360c_destroy_urb(controller->out);
-}
+	const struct xpad360c_transport *transport);
+void xpad360c_destroy(struct xpad360_controller *controller);
+
+void xpad360c_stop_input(struct xpad360_controller *controller);
+int xpad360c_start_input(struct xpad360_controller *controller);
+void xpad360c_suspend(struct xpad360_controller *controller); /* Sleeps */
+int xpad360c_resume(struct xpad360_controller *controller);
@@ -0,0 +1,248 @@
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+
+#include "xpad360c.h"
+
+/*
+ * State shared by every controller on the same usb device.
+ *
+ * For now that's the keepalive timer. Attachments like the chatpad need a
+ * packet every second or so. Instead of a timer per controller, every
+ * controller on the adapter that needs one is served by a single delayed work,
+ * rounded to a whole second so it lines up with other timers in the system.
+ * It's only armed while somebody needs it, an adapter without attachments
+ * never wakes up for it.
+ *
+ * An attachment that hasn't acknowledged anything for a while is gone.
+ * The chatpad is the only attachment with a keepalive, so it gets detached.
+ */
+
+#define XPAD360C_KEEPALIVE_INTERVAL HZ
+#define XPAD360C_KEEPALIVE_TIMEOUT (3 * HZ)
+
+struct xpad360c_adapter {
+	struct list_head node;
+	struct kref kref;
+	struct usb_device *usbdev;
+
+	struct mutex mutex; /* Protects keepalives */
+	struct list_head keepalives;
+	struct delayed_work keepalive_work;
+};
+
+static LIST_HEAD(xpad360c_adapters);
+static DEFINE_MUTEX(xpad360c_adapters_mutex);
+
+static void xpad360c_keepalive_complete(struct urb *urb)
+{
+	struct xpad360_controller *controller = urb->context;
+
+	WRITE_ONCE(controller->keepalive_busy, false);
+}
+
+/* Must be called with the adapter mutex held. */
+static void xpad360c_keepalive_send(struct xpad360_controller *controller)
+{
+	struct urb *urb = controller->keepalive_urb;
+
+	/* Still in flight from last time. Skip a beat rather than allocate. */
+	if (READ_ONCE(controller->keepalive_busy))
+		return;
+
+	urb->transfer_buffer_length =
+		controller->transport->keepalive(urb->transfer_buffer, controller->keepalive_tick++);
+
+	WRITE_ONCE(controller->keepalive_busy, true);
+
+	if (usb_submit_urb(urb, GFP_KERNEL)) {
+		dev_dbg(&urb->dev->dev, "usb_submit_urb() failed in keepalive_send()!");
+		WRITE_ONCE(controller->keepalive_busy, false);
+	}
+}
+
+static void xpad360c_keepalive_work(struct work_struct *work)
+{
+	struct xpad360c_adapter *adapter =
+		container_of(to_delayed_work(work), struct xpad360c_adapter, keepalive_work);
+	struct xpad360_controller *controller;
+
+	mutex_lock(&adapter->mutex);
+
+	list_for_each_entry(controller, &adapter->keepalives, keepalive_node) {
+		/* Detaching stops the keepalive, which takes our mutex. */
+		if (time_after(jiffies, READ_ONCE(controller->keepalive_ack) + XPAD360C_KEEPALIVE_TIMEOUT)) {
+			schedule_work(&controller->chatpad_work);
+			continue;
+		}
+
+		xpad360c_keepalive_send(controller);
+	}
+
+	if (!list_empty(&adapter->keepalives))
+		schedule_delayed_work(&adapter->keepalive_work,
+			round_jiffies_relative(XPAD360C_KEEPALIVE_INTERVAL));
+
+	mutex_unlock(&adapter->mutex);
+}
+
+/* Must be called with the adapter mutex held. Sends the first keepalive right away. */
+static void xpad360c_keepalive_add(
+	struct xpad360c_adapter *adapter,
+	struct xpad360_controller *controller)
+{
+	controller->keepalive_tick = 0;
+	WRITE_ONCE(controller->keepalive_ack, jiffies);
+	xpad360c_keepalive_send(controller);
+
+	if (list_empty(&adapter->keepalives))
+		schedule_delayed_work(&adapter->keepalive_work,
+			round_jiffies_relative(XPAD360C_KEEPALIVE_INTERVAL));
+
+	list_add(&controller->keepalive_node, &adapter->keepalives);
+}
+
+struct xpad360c_adapter *xpad360c_adapter_get(struct usb_device *usbdev)
+{
+	struct xpad360c_adapter *adapter;
+
+	mutex_lock(&xpad360c_adapters_mutex);
+
+	list_for_each_entry(adapter, &xpad360c_adapters, node) {
+		if (adapter->usbdev == usbdev) {
+			kref_get(&adapter->kref);
+			goto unlock;
+		}
+	}
+
+	adapter = kzalloc(sizeof(struct xpad360c_adapter), GFP_KERNEL);
+	if (!adapter)
+		goto unlock;
+
+	kref_init(&adapter->kref);
+	adapter->usbdev = usbdev;
+	mutex_init(&adapter->mutex);
+	INIT_LIST_HEAD(&adapter->keepalives);
+	INIT_DELAYED_WORK(&adapter->keepalive_work, xpad360c_keepalive_work);
+
+	list_add(&adapter->node, &xpad360c_adapters);
+
+unlock:
+	mutex_unlock(&xpad360c_adapters_mutex);
+	return adapter;
+}
+
+static void xpad360c_adapter_release(struct kref *kref)
+{
+	struct xpad360c_adapter *adapter = container_of(kref, struct xpad360c_adapter, kref);
+
+	list_del(&adapter->node);
+	cancel_delayed_work_sync(&adapter->keepalive_work);
+	kfree(adapter);
+}
+
+void xpad360c_adapter_put(struct xpad360c_adapter *adapter)
+{
+	if (!adapter)
+		return;
+
+	mutex_lock(&xpad360c_adapters_mutex);
+	kref_put(&adapter->kref, xpad360c_adapter_release);
+	mutex_unlock(&xpad360c_adapters_mutex);
+}
+
+/* The first keepalive goes out right away, so the attachment is set up without waiting. */
+int xpad360c_keepalive_start(struct xpad360_controller *controller)
+{
+	struct xpad360c_adapter *adapter = controller->adapter;
+
+	if (!adapter || !controller->transport->keepalive)
+		return -ENODEV;
+
+	mutex_lock(&adapter->mutex);
+
+	if (controller->keepalive_urb)
+		goto unlock;
+
+	controller->keepalive_urb =
+	xpad360c_allocate_urb(
+		controller->out->dev, controller->out->pipe,
+		xpad360c_keepalive_complete, GFP_KERNEL
+	);
+
+	if (!controller->keepalive_urb) {
+		mutex_unlock(&adapter->mutex);
+		return -ENOMEM;
+	}
+
+	controller->keepalive_urb->context = controller;
+	controller->keepalive_busy = false;
+
+	xpad360c_keepalive_add(adapter, controller);
+
+unlock:
+	mutex_unlock(&adapter->mutex);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(xpad360c_keepalive_start);
+
+void xpad360c_keepalive_stop(struct xpad360_controller *controller)
+{
+	struct xpad360c_adapter *adapter = controller->adapter;
+
+	if (!adapter)
+		return;
+
+	mutex_lock(&adapter->mutex);
+
+	if (controller->keepalive_urb) {
+		/* The work notices the empty list by itself. */
+		list_del_init(&controller->keepalive_node);
+
+		usb_kill_urb(controller->keepalive_urb);
+		xpad360c_destroy_urb(controller->keepalive_urb);
+		controller->keepalive_urb = NULL;
+	}
+
+	mutex_unlock(&adapter->mutex);
+}
+EXPORT_SYMBOL_GPL(xpad360c_keepalive_stop);
+
+void xpad360c_keepalive_ack(struct xpad360_controller *controller)
+{
+	WRITE_ONCE(controller->keepalive_ack, jiffies);
+}
+EXPORT_SYMBOL_GPL(xpad360c_keepalive_ack);
+
+/* Keeps the urb, the attachment is set up again from tick 0 on resume. */
+void xpad360c_keepalive_suspend(struct xpad360_controller *controller)
+{
+	struct xpad360c_adapter *adapter = controller->adapter;
+
+	if (!adapter)
+		return;
+
+	mutex_lock(&adapter->mutex);
+
+	if (controller->keepalive_urb) {
+		list_del_init(&controller->keepalive_node);
+		usb_kill_urb(controller->keepalive_urb);
+	}
+
+	mutex_unlock(&adapter->mutex);
+}
+
+void xpad360c_keepalive_resume(struct xpad360_controller *controller)
+{
+	struct xpad360c_adapter *adapter = controller->adapter;
+
+	if (!adapter)
+		return;
+
+	mutex_lock(&adapter->mutex);
+
+	if (controller->keepalive_urb && list_empty(&controller->keepalive_node))
+		xpad360c_keepalive_add(adapter, controller);
+
+	mutex_unlock(&adapter->mutex);
+}
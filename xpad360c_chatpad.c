@@ -0,0 +1,206 @@
+#include "xpad360c.h"
+
+/*
+ * Chatpad.
+ *
+ * Key reports are three bytes: modifiers, then up to two keys held down.
+ * Keys are positions in the key matrix (row << 4 | column), translated through
+ * a keymap which userspace can change with EVIOCSKEYCODE.
+ * The chatpad is its own input device, keyboards and gamepads don't mix well.
+ *
+ * It goes away when the transport says so, or when it stops acknowledging
+ * keepalives, see xpad360c_adapter.c.
+ */
+
+#define XPAD360C_CHATPAD_KEYS 0x80
+
+struct xpad360c_chatpad {
+	struct input_dev *inputdev;
+	char phys[64];
+
+	unsigned short keymap[XPAD360C_CHATPAD_KEYS];
+	u8 modifiers;
+	u8 keys[2];
+};
+
+static const unsigned short xpad360c_chatpad_keymap[XPAD360C_CHATPAD_KEYS] = {
+	[0x17] = KEY_1, [0x16] = KEY_2, [0x15] = KEY_3, [0x14] = KEY_4, [0x13] = KEY_5,
+	[0x12] = KEY_6, [0x11] = KEY_7, [0x67] = KEY_8, [0x66] = KEY_9, [0x65] = KEY_0,
+
+	[0x27] = KEY_Q, [0x26] = KEY_W, [0x25] = KEY_E, [0x24] = KEY_R, [0x23] = KEY_T,
+	[0x22] = KEY_Y, [0x21] = KEY_U, [0x76] = KEY_I, [0x75] = KEY_O, [0x64] = KEY_P,
+
+	[0x37] = KEY_A, [0x36] = KEY_S, [0x35] = KEY_D, [0x34] = KEY_F, [0x33] = KEY_G,
+	[0x32] = KEY_H, [0x31] = KEY_J, [0x77] = KEY_K, [0x72] = KEY_L, [0x62] = KEY_COMMA,
+
+	[0x46] = KEY_Z, [0x45] = KEY_X, [0x44] = KEY_C, [0x43] = KEY_V, [0x42] = KEY_B,
+	[0x41] = KEY_N, [0x52] = KEY_M, [0x53] = KEY_DOT, [0x63] = KEY_ENTER,
+
+	[0x55] = KEY_LEFT, [0x54] = KEY_SPACE, [0x51] = KEY_RIGHT, [0x71] = KEY_BACKSPACE,
+};
+
+/* Bits of the modifier byte. */
+static const unsigned short xpad360c_chatpad_modifiers[] = {
+	KEY_LEFTSHIFT, /* Shift */
+	KEY_LEFTCTRL, /* Green */
+	KEY_RIGHTALT, /* Orange */
+	KEY_LEFTMETA, /* Messenger */
+};
+
+static void xpad360c_chatpad_key(struct xpad360c_chatpad *chatpad, u8 key, int value)
+{
+	if (key && key < XPAD360C_CHATPAD_KEYS && chatpad->keymap[key])
+		input_report_key(chatpad->inputdev, chatpad->keymap[key], value);
+}
+
+void xpad360c_chatpad_report(struct xpad360_controller *controller, const u8 *data)
+{
+	struct xpad360c_chatpad *chatpad;
+	int i = 0;
+
+	mutex_lock(&controller->chatpad_mutex);
+
+	chatpad = controller->chatpad;
+	if (!chatpad)
+		goto unlock;
+
+	for (; i < ARRAY_SIZE(xpad360c_chatpad_modifiers); ++i)
+		input_report_key(chatpad->inputdev, xpad360c_chatpad_modifiers[i], data[0] & BIT(i));
+
+	/* Release what's no longer held, then press what's new. */
+	for (i = 0; i < 2; ++i) {
+		if (chatpad->keys[i] != data[1] && chatpad->keys[i] != data[2])
+			xpad360c_chatpad_key(chatpad, chatpad->keys[i], 0);
+	}
+
+	for (i = 1; i < 3; ++i) {
+		if (data[i] != chatpad->keys[0] && data[i] != chatpad->keys[1])
+			xpad360c_chatpad_key(chatpad, data[i], 1);
+	}
+
+	chatpad->modifiers = data[0];
+	chatpad->keys[0] = data[1];
+	chatpad->keys[1] = data[2];
+
+	input_sync(chatpad->inputdev);
+
+unlock:
+	mutex_unlock(&controller->chatpad_mutex);
+}
+EXPORT_SYMBOL_GPL(xpad360c_chatpad_report);
+
+int xpad360c_chatpad_attach(struct xpad360_controller *controller)
+{
+	struct usb_device *usbdev = interface_to_usbdev(controller->interface);
+	struct xpad360c_chatpad *chatpad;
+	struct input_dev *inputdev;
+	int error = 0;
+	int i = 0;
+
+	mutex_lock(&controller->chatpad_mutex);
+
+	if (controller->chatpad)
+		goto unlock;
+
+	chatpad = kzalloc(sizeof(struct xpad360c_chatpad), GFP_KERNEL);
+	if (!chatpad) {
+		error = -ENOMEM;
+		goto unlock;
+	}
+
+	inputdev = input_allocate_device();
+	if (!inputdev) {
+		error = -ENOMEM;
+		goto fail0;
+	}
+
+	snprintf(chatpad->phys, sizeof(chatpad->phys), "%s/chatpad", controller->path);
+	memcpy(chatpad->keymap, xpad360c_chatpad_keymap, sizeof(chatpad->keymap));
+
+	inputdev->name = "Xbox 360 Chatpad";
+	inputdev->phys = chatpad->phys;
+	inputdev->dev.parent = &controller->interface->dev;
+	usb_to_input_id(usbdev, &inputdev->id);
+
+	inputdev->keycode = chatpad->keymap;
+	inputdev->keycodesize = sizeof(chatpad->keymap[0]);
+	inputdev->keycodemax = ARRAY_SIZE(chatpad->keymap);
+
+	__set_bit(EV_KEY, inputdev->evbit);
+	__set_bit(EV_REP, inputdev->evbit);
+
+	for (; i < XPAD360C_CHATPAD_KEYS; ++i)
+		__set_bit(chatpad->keymap[i], inputdev->keybit);
+
+	for (i = 0; i < ARRAY_SIZE(xpad360c_chatpad_modifiers); ++i)
+		__set_bit(xpad360c_chatpad_modifiers[i], inputdev->keybit);
+
+	__clear_bit(KEY_RESERVED, inputdev->keybit);
+
+	chatpad->inputdev = inputdev;
+
+	error = input_register_device(inputdev);
+	if (error)
+		goto fail1;
+
+	controller->chatpad = chatpad;
+
+	/* Not fatal, keys still come in until the chatpad gives up on us. */
+	if (xpad360c_keepalive_start(controller))
+		dev_dbg(&usbdev->dev, "Failed to start chatpad keepalive!");
+
+	goto unlock;
+
+fail1:
+	input_free_device(inputdev);
+fail0:
+	kfree(chatpad);
+unlock:
+	mutex_unlock(&controller->chatpad_mutex);
+	return error;
+}
+EXPORT_SYMBOL_GPL(xpad360c_chatpad_attach);
+
+/* Must be called with the chatpad mutex held. */
+static void xpad360c_chatpad_remove(struct xpad360_controller *controller)
+{
+	struct xpad360c_chatpad *chatpad = controller->chatpad;
+
+	if (!chatpad)
+		return;
+
+	xpad360c_keepalive_stop(controller);
+
+	input_unregister_device(chatpad->inputdev);
+	controller->chatpad = NULL;
+	kfree(chatpad);
+}
+
+void xpad360c_chatpad_detach(struct xpad360_controller *controller)
+{
+	mutex_lock(&controller->chatpad_mutex);
+	xpad360c_chatpad_remove(controller);
+	mutex_unlock(&controller->chatpad_mutex);
+
+	/* Only the keepalive schedules it, and that's stopped now. */
+	cancel_work_sync(&controller->chatpad_work);
+}
+EXPORT_SYMBOL_GPL(xpad360c_chatpad_detach);
+
+static void xpad360c_chatpad_work(struct work_struct *work)
+{
+	struct xpad360_controller *controller =
+		container_of(work, struct xpad360_controller, chatpad_work);
+
+	dev_dbg(&controller->interface->dev, "Chatpad stopped answering, detaching.\n");
+
+	mutex_lock(&controller->chatpad_mutex);
+	xpad360c_chatpad_remove(controller);
+	mutex_unlock(&controller->chatpad_mutex);
+}
+
+void xpad360c_chatpad_init(struct xpad360_controller *controller)
+{
+	mutex_init(&controller->chatpad_mutex);
+	INIT_WORK(&controller->chatpad_work, xpad360c_chatpad_work);
+}
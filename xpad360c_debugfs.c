@@ -0,0 +1,172 @@
+#include <linux/debugfs.h>
+#include <linux/delay.h>
+#include <linux/sched/signal.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
+
+#include "xpad360c.h"
+
+/*
+ * Packet injection for benchmarking without hardware.
+ *
+ * Each controller gets xpad360/<interface>/ in debugfs with:
+ *	inject: Write records of one length byte followed by that many bytes of
+ *		raw report. They go through the transport decoder exactly like a
+ *		completed in urb would.
+ *	inject_rate: Records per second, 0 feeds them as fast as possible.
+ *	stats: Throughput of the last injected batch, the slowest single decode
+ *		and a few counters. tools/xpad360-inject-stress drives all of it.
+ */
+
+#define XPAD360C_INJECT_MAX_LENGTH 64
+
+/* Longest nap between paced records, in us. Keeps a slow batch responsive to disconnect. */
+#define XPAD360C_INJECT_MAX_SLEEP 10000
+
+static struct dentry *xpad360c_debugfs_root;
+
+static ssize_t xpad360c_inject_write(
+	struct file *file,
+	const char __user *buffer,
+	size_t count,
+	loff_t *ppos)
+{
+	struct xpad360_controller *controller = file->private_data;
+	struct xpad360c_inject *inject = &controller->inject;
+	u8 data[XPAD360C_INJECT_MAX_LENGTH];
+	u32 rate = READ_ONCE(inject->rate);
+	ktime_t start = ktime_get();
+	size_t written = 0;
+	ssize_t error = 0;
+	u64 packets = 0;
+	u64 max_ns = 0;
+	unsigned long flags;
+	ktime_t now;
+	u8 length;
+
+	while (written < count) {
+		if (get_user(length, buffer + written)) {
+			error = -EFAULT;
+			break;
+		}
+
+		if (length > sizeof(data)) {
+			error = -EINVAL;
+			break;
+		}
+
+		/* Only whole records are taken. */
+		if (written + 1 + length > count)
+			break;
+
+		if (copy_from_user(data, buffer + written + 1, length)) {
+			error = -EFAULT;
+			break;
+		}
+
+		if (rate) {
+			ktime_t due = ktime_add_ns(start, div_u64(packets * NSEC_PER_SEC, rate));
+			s64 wait;
+
+			while ((wait = ktime_us_delta(due, ktime_get())) > 0 &&
+			       !READ_ONCE(controller->stopped) && !signal_pending(current)) {
+				wait = min_t(s64, wait, XPAD360C_INJECT_MAX_SLEEP);
+				usleep_range(wait, wait + 50);
+			}
+		}
+
+		/* Disconnect waits for us, don't keep it waiting. */
+		if (READ_ONCE(controller->stopped)) {
+			error = -ENODEV;
+			break;
+		}
+
+		if (signal_pending(current)) {
+			error = -ERESTARTSYS;
+			break;
+		}
+
+		/* The in urb completion may be decoding on another CPU,
+		   or interrupt us on this one on host controllers that complete in hardirq. */
+		spin_lock_irqsave(&controller->decode_lock, flags);
+		now = ktime_get();
+		controller->transport->decode(controller, data, length, now);
+		max_ns = max_t(u64, max_ns, ktime_to_ns(ktime_sub(ktime_get(), now)));
+		spin_unlock_irqrestore(&controller->decode_lock, flags);
+
+		written += 1 + length;
+		++packets;
+
+		if (!rate)
+			cond_resched();
+	}
+
+	inject->last_packets = packets;
+	inject->last_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	inject->total_packets += packets;
+	inject->last_max_ns = max_ns;
+	inject->max_ns = max(inject->max_ns, max_ns);
+
+	return written ? written : error;
+}
+
+static const struct file_operations xpad360c_inject_fops = {
+	.owner = THIS_MODULE,
+	.open = simple_open,
+	.write = xpad360c_inject_write,
+};
+
+static int xpad360c_stats_show(struct seq_file *file, void *unused)
+{
+	struct xpad360_controller *controller = file->private;
+	struct xpad360c_inject *inject = &controller->inject;
+	u64 rate = inject->last_ns ?
+		div64_u64(inject->last_packets * NSEC_PER_SEC, inject->last_ns) : 0;
+
+	seq_printf(file, "injected: %llu\n", inject->total_packets);
+	seq_printf(file, "last_batch_packets: %llu\n", inject->last_packets);
+	seq_printf(file, "last_batch_ns: %llu\n", inject->last_ns);
+	seq_printf(file, "last_batch_packets_per_sec: %llu\n", rate);
+	seq_printf(file, "last_batch_max_packet_ns: %llu\n", inject->last_max_ns);
+	seq_printf(file, "max_packet_ns: %llu\n", inject->max_ns);
+	seq_printf(file, "sequence: %u\n", controller->sequence);
+	seq_printf(file, "recoveries: %u\n", controller->recoveries);
+	seq_printf(file, "resume_latency_us: %lld\n", controller->resume_latency_us);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xpad360c_stats);
+
+void xpad360c_debugfs_init(struct xpad360_controller *controller)
+{
+	struct dentry *dir;
+
+	dir = debugfs_create_dir(dev_name(&controller->interface->dev), xpad360c_debugfs_root);
+
+	debugfs_create_file("inject", 0200, dir, controller, &xpad360c_inject_fops);
+	debugfs_create_u32("inject_rate", 0600, dir, &controller->inject.rate);
+	debugfs_create_file("stats", 0400, dir, controller, &xpad360c_stats_fops);
+
+	if (controller->transport->debugfs)
+		controller->transport->debugfs(controller, dir);
+
+	controller->debugfs = dir;
+}
+EXPORT_SYMBOL_GPL(xpad360c_debugfs_init);
+
+void xpad360c_debugfs_destroy(struct xpad360_controller *controller)
+{
+	debugfs_remove_recursive(controller->debugfs);
+	controller->debugfs = NULL;
+}
+EXPORT_SYMBOL_GPL(xpad360c_debugfs_destroy);
+
+void xpad360c_debugfs_create_root(void)
+{
+	xpad360c_debugfs_root = debugfs_create_dir("xpad360", NULL);
+}
+
+void xpad360c_debugfs_remove_root(void)
+{
+	debugfs_remove_recursive(xpad360c_debugfs_root);
+}
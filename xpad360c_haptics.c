@@ -0,0 +1,439 @@
+#include <linux/hrtimer.h>
+#include <linux/kfifo.h>
+#include <linux/kref.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+
+#include "xpad360c.h"
+#include "xpad360_haptics.h"
+
+/*
+ * Streaming haptics.
+ *
+ * Userspace queues timestamped frames, an hrtimer pops them when they're due
+ * and sends the newest one on a preallocated urb. Only one urb is ever in
+ * flight, if the controller is slower than the stream, frames that became due
+ * in the meantime are skipped and only the newest one is sent on completion.
+ *
+ * Writers block while the queue is full unless the file is O_NONBLOCK,
+ * and poll says when there's room again.
+ *
+ * The device node can outlive the controller, so everything here is refcounted
+ * and goes through dead once the controller is gone. The urb can't outlive it,
+ * freeing it needs the endpoint, so it goes away with the controller.
+ */
+
+struct xpad360c_haptics_frame {
+	ktime_t time;
+	u8 strong;
+	u8 weak;
+};
+
+struct xpad360c_haptics {
+	struct kref kref;
+	struct miscdevice misc;
+	char name[48];
+	wait_queue_head_t wait; /* Writers waiting for room in frames */
+
+	spinlock_t lock; /* Protects everything below */
+	bool dead;
+	bool suspended; /* Frames stay queued until resume */
+
+	const struct xpad360c_transport *transport;
+	struct urb *urb; /* NULL once dead */
+	bool busy; /* urb is in flight */
+	bool pending; /* next is waiting for the urb */
+	struct xpad360c_haptics_frame next;
+
+	struct hrtimer timer;
+	bool playing;
+	ktime_t start;
+	u8 last_strong, last_weak;
+
+	DECLARE_KFIFO(frames, struct xpad360c_haptics_frame, 256);
+
+	struct xpad360_haptics_status stats;
+};
+
+static void xpad360c_haptics_release_kref(struct kref *kref)
+{
+	struct xpad360c_haptics *haptics = container_of(kref, struct xpad360c_haptics, kref);
+
+	kfree(haptics);
+}
+
+/* Must be called with the lock held. */
+static void xpad360c_haptics_send(struct xpad360c_haptics *haptics, struct xpad360c_haptics_frame *frame)
+{
+	struct urb *urb = haptics->urb;
+
+	if (haptics->dead || haptics->suspended)
+		return;
+
+	if (haptics->busy) {
+		if (haptics->pending)
+			++haptics->stats.skipped;
+
+		haptics->next = *frame;
+		haptics->pending = true;
+		return;
+	}
+
+	urb->transfer_buffer_length =
+		haptics->transport->rumble(urb->transfer_buffer, frame->strong, frame->weak);
+
+	if (unlikely(usb_submit_urb(urb, GFP_ATOMIC) != 0)) {
+		dev_dbg(&urb->dev->dev, "usb_submit_urb() failed in haptics_send()!");
+		return;
+	}
+
+	haptics->busy = true;
+	haptics->last_strong = frame->strong;
+	haptics->last_weak = frame->weak;
+	++haptics->stats.played;
+}
+
+static void xpad360c_haptics_complete(struct urb *urb)
+{
+	struct xpad360c_haptics *haptics = urb->context;
+	unsigned long flags;
+
+	spin_lock_irqsave(&haptics->lock, flags);
+
+	haptics->busy = false;
+
+	if (haptics->pending && urb->status == 0) {
+		haptics->pending = false;
+		xpad360c_haptics_send(haptics, &haptics->next);
+	}
+
+	spin_unlock_irqrestore(&haptics->lock, flags);
+}
+
+static enum hrtimer_restart xpad360c_haptics_tick(struct hrtimer *timer)
+{
+	struct xpad360c_haptics *haptics = container_of(timer, struct xpad360c_haptics, timer);
+	struct xpad360c_haptics_frame frame, due;
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	unsigned long flags;
+	ktime_t now = ktime_get();
+	bool found = false;
+
+	spin_lock_irqsave(&haptics->lock, flags);
+
+	if (haptics->dead || haptics->suspended)
+		goto unlock;
+
+	/* Only the newest frame that's due matters. */
+	while (kfifo_peek(&haptics->frames, &frame) && frame.time <= now) {
+		kfifo_skip(&haptics->frames);
+
+		if (found)
+			++haptics->stats.skipped;
+
+		due = frame;
+		found = true;
+	}
+
+	if (found)
+		xpad360c_haptics_send(haptics, &due);
+
+	if (kfifo_peek(&haptics->frames, &frame)) {
+		hrtimer_set_expires(timer, frame.time);
+		restart = HRTIMER_RESTART;
+	} else {
+		haptics->playing = false;
+
+		if (haptics->last_strong || haptics->last_weak)
+			++haptics->stats.underruns;
+	}
+
+unlock:
+	spin_unlock_irqrestore(&haptics->lock, flags);
+
+	/* Popping frames made room. */
+	if (found)
+		wake_up_interruptible(&haptics->wait);
+
+	return restart;
+}
+
+static int xpad360c_haptics_open(struct inode *inode, struct file *file)
+{
+	struct xpad360c_haptics *haptics =
+		container_of(file->private_data, struct xpad360c_haptics, misc);
+
+	kref_get(&haptics->kref);
+	file->private_data = haptics;
+
+	return nonseekable_open(inode, file);
+}
+
+static int xpad360c_haptics_release(struct inode *inode, struct file *file)
+{
+	struct xpad360c_haptics *haptics = file->private_data;
+
+	kref_put(&haptics->kref, xpad360c_haptics_release_kref);
+	return 0;
+}
+
+/* Room for another frame, or nothing left to wait for. */
+static bool xpad360c_haptics_writable(struct xpad360c_haptics *haptics)
+{
+	unsigned long flags;
+	bool writable;
+
+	spin_lock_irqsave(&haptics->lock, flags);
+	writable = haptics->dead || !kfifo_is_full(&haptics->frames);
+	spin_unlock_irqrestore(&haptics->lock, flags);
+
+	return writable;
+}
+
+/* Queues whole frames, waiting for room unless the file is O_NONBLOCK. */
+static ssize_t xpad360c_haptics_write(
+	struct file *file,
+	const char __user *buffer,
+	size_t count,
+	loff_t *ppos)
+{
+	struct xpad360c_haptics *haptics = file->private_data;
+	struct xpad360_haptics_frame user_frame;
+	struct xpad360c_haptics_frame frame;
+	unsigned long flags;
+	size_t written = 0;
+	ssize_t error = 0;
+
+	if (count < sizeof(user_frame))
+		return -EINVAL;
+
+	while (written + sizeof(user_frame) <= count) {
+		if (!(file->f_flags & O_NONBLOCK)) {
+			error = wait_event_interruptible(haptics->wait, xpad360c_haptics_writable(haptics));
+			if (error)
+				break;
+		}
+
+		if (copy_from_user(&user_frame, buffer + written, sizeof(user_frame))) {
+			error = -EFAULT;
+			break;
+		}
+
+		spin_lock_irqsave(&haptics->lock, flags);
+
+		if (haptics->dead) {
+			spin_unlock_irqrestore(&haptics->lock, flags);
+			error = -ENODEV;
+			break;
+		}
+
+		if (!haptics->playing) {
+			haptics->playing = true;
+			haptics->start = ktime_get();
+		}
+
+		frame.time = ktime_add_us(haptics->start, user_frame.time_us);
+		frame.strong = user_frame.strong >> 8;
+		frame.weak = user_frame.weak >> 8;
+
+		if (!kfifo_put(&haptics->frames, frame)) {
+			/* Another writer beat us to the room. Wait again. */
+			if (!(file->f_flags & O_NONBLOCK)) {
+				spin_unlock_irqrestore(&haptics->lock, flags);
+				continue;
+			}
+
+			haptics->stats.overruns += (count - written) / sizeof(user_frame);
+			spin_unlock_irqrestore(&haptics->lock, flags);
+			error = -EAGAIN;
+			break;
+		}
+
+		/* The timer always sleeps until the oldest frame. */
+		if (kfifo_len(&haptics->frames) == 1)
+			hrtimer_start(&haptics->timer, frame.time, HRTIMER_MODE_ABS);
+
+		spin_unlock_irqrestore(&haptics->lock, flags);
+		written += sizeof(user_frame);
+	}
+
+	return written ? written : error;
+}
+
+static __poll_t xpad360c_haptics_poll(struct file *file, poll_table *wait)
+{
+	struct xpad360c_haptics *haptics = file->private_data;
+	unsigned long flags;
+	__poll_t mask = 0;
+
+	poll_wait(file, &haptics->wait, wait);
+
+	spin_lock_irqsave(&haptics->lock, flags);
+
+	if (haptics->dead)
+		mask = EPOLLERR | EPOLLHUP;
+	else if (!kfifo_is_full(&haptics->frames))
+		mask = EPOLLOUT | EPOLLWRNORM;
+
+	spin_unlock_irqrestore(&haptics->lock, flags);
+
+	return mask;
+}
+
+static ssize_t xpad360c_haptics_read(
+	struct file *file,
+	char __user *buffer,
+	size_t count,
+	loff_t *ppos)
+{
+	struct xpad360c_haptics *haptics = file->private_data;
+	struct xpad360_haptics_status status;
+	unsigned long flags;
+
+	if (count < sizeof(status))
+		return -EINVAL;
+
+	spin_lock_irqsave(&haptics->lock, flags);
+
+	status = haptics->stats;
+	status.queued = kfifo_len(&haptics->frames);
+	status.playing = haptics->playing;
+	status.stream_time_us = haptics->playing ?
+		ktime_us_delta(ktime_get(), haptics->start) : 0;
+
+	spin_unlock_irqrestore(&haptics->lock, flags);
+
+	if (copy_to_user(buffer, &status, sizeof(status)))
+		return -EFAULT;
+
+	return sizeof(status);
+}
+
+static const struct file_operations xpad360c_haptics_fops = {
+	.owner = THIS_MODULE,
+	.open = xpad360c_haptics_open,
+	.release = xpad360c_haptics_release,
+	.write = xpad360c_haptics_write,
+	.read = xpad360c_haptics_read,
+	.poll = xpad360c_haptics_poll,
+};
+
+int xpad360c_haptics_init(struct xpad360_controller *controller)
+{
+	struct xpad360c_haptics *haptics;
+	int error = 0;
+
+	if (controller->haptics)
+		return 0;
+
+	haptics = kzalloc(sizeof(struct xpad360c_haptics), GFP_KERNEL);
+	if (!haptics)
+		return -ENOMEM;
+
+	kref_init(&haptics->kref);
+	init_waitqueue_head(&haptics->wait);
+	spin_lock_init(&haptics->lock);
+	INIT_KFIFO(haptics->frames);
+	hrtimer_setup(&haptics->timer, xpad360c_haptics_tick, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	haptics->transport = controller->transport;
+
+	haptics->urb =
+	xpad360c_allocate_urb(
+		controller->out->dev, controller->out->pipe,
+		xpad360c_haptics_complete, GFP_KERNEL
+	);
+
+	if (!haptics->urb) {
+		error = -ENOMEM;
+		goto fail0;
+	}
+
+	haptics->urb->context = haptics;
+
+	snprintf(haptics->name, sizeof(haptics->name),
+		"xpad360-haptics-%s", dev_name(&controller->interface->dev));
+
+	haptics->misc.minor = MISC_DYNAMIC_MINOR;
+	haptics->misc.name = haptics->name;
+	haptics->misc.fops = &xpad360c_haptics_fops;
+	haptics->misc.parent = &controller->interface->dev;
+
+	error = misc_register(&haptics->misc);
+	if (error)
+		goto fail1;
+
+	controller->haptics = haptics;
+	return 0;
+
+fail1:
+	xpad360c_destroy_urb(haptics->urb);
+fail0:
+	kfree(haptics);
+	return error;
+}
+EXPORT_SYMBOL_GPL(xpad360c_haptics_init);
+
+void xpad360c_haptics_destroy(struct xpad360_controller *controller)
+{
+	struct xpad360c_haptics *haptics = controller->haptics;
+	unsigned long flags;
+
+	if (!haptics)
+		return;
+
+	misc_deregister(&haptics->misc);
+
+	spin_lock_irqsave(&haptics->lock, flags);
+	haptics->dead = true;
+	spin_unlock_irqrestore(&haptics->lock, flags);
+
+	wake_up_interruptible(&haptics->wait);
+	hrtimer_cancel(&haptics->timer);
+	usb_kill_urb(haptics->urb);
+
+	/* Nothing submits once dead, open files only keep the rest alive. */
+	xpad360c_destroy_urb(haptics->urb);
+	haptics->urb = NULL;
+
+	controller->haptics = NULL;
+	kref_put(&haptics->kref, xpad360c_haptics_release_kref);
+}
+EXPORT_SYMBOL_GPL(xpad360c_haptics_destroy);
+
+/* Nothing is sent while suspended, frames that came due meanwhile are skipped on resume. */
+void xpad360c_haptics_suspend(struct xpad360_controller *controller)
+{
+	struct xpad360c_haptics *haptics = controller->haptics;
+	unsigned long flags;
+
+	if (!haptics)
+		return;
+
+	spin_lock_irqsave(&haptics->lock, flags);
+	haptics->suspended = true;
+	spin_unlock_irqrestore(&haptics->lock, flags);
+
+	hrtimer_cancel(&haptics->timer);
+	usb_kill_urb(haptics->urb);
+}
+
+void xpad360c_haptics_resume(struct xpad360_controller *controller)
+{
+	struct xpad360c_haptics *haptics = controller->haptics;
+	struct xpad360c_haptics_frame frame;
+	unsigned long flags;
+
+	if (!haptics)
+		return;
+
+	spin_lock_irqsave(&haptics->lock, flags);
+
+	haptics->suspended = false;
+
+	if (kfifo_peek(&haptics->frames, &frame))
+		hrtimer_start(&haptics->timer, frame.time, HRTIMER_MODE_ABS);
+
+	spin_unlock_irqrestore(&haptics->lock, flags);
+}
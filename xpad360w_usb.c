@@ -13,86 +13,43 @@ static struct usb_device_id xpad360w_table[] = {
 	{}
 };
 
-static int xpad360w_rumble(struct input_dev *dev, void* stuff, struct ff_effect *effect)
+/* Buffer must have 8 writeable bytes ahead of it! */
+static size_t xpad360w_rumble_packet(void *buffer, u8 left, u8 rite)
 {
-	struct xpad360_controller *controller = stuff;
-	int status = -1;
+	const u8 packet[8] = { 
+		0x00, 0x08, 0x00, 
+		left, rite,
+		0x00, 0x00, 0x00 
+	};
 
-	if (effect->type == FF_RUMBLE) {
-		struct urb *urb = xpad360c_copy_urb(controller->out, GFP_ATOMIC);
-
-		u8 left = effect->u.rumble.strong_magnitude / 255;
-		u8 rite = effect->u.rumble.weak_magnitude / 255;
-		
-		const u8 packet[8] = { 
-			0x00, 0x08, 0x00, 
-			left, rite,
-			0x00, 0x00, 0x00 
-		};
-
-		memcpy(urb->transfer_buffer, packet, sizeof(packet));
-
-		urb->transfer_buffer_length = 8;
-
-		usb_anchor_urb(urb, &controller->out_anchor);
-
-		status = !!usb_submit_urb(urb, GFP_ATOMIC);
-	}
-	
-	return status;
+	memcpy(buffer, packet, sizeof(packet));
+	return sizeof(packet);
 }
 
-/* Data must be a buffer with 3 writeable bytes ahead of it!*/
-static void xpad360w_generate_led_packet(void* buffer, u8 status)
+/* Buffer must have 3 writeable bytes ahead of it! */
+static size_t xpad360w_led_packet(void* buffer, u8 status)
 {
 	const u8 packet[3] = { 0x01, 0x03, status };
-	memcpy(buffer, packet, sizeof(packet));
-}
 
-static void xpad360w_led_sync(struct xpad360_controller *controller, u8 status) 
-{
-	struct usb_device *usbdev = controller->out->dev;
-	struct device *device = &usbdev->dev;
-	u8 packet[3];
-	int error = 0;
-	
-	xpad360w_generate_led_packet(packet, status);
-	
-	error = 
-	usb_interrupt_msg(
-		usbdev,	controller->out->pipe,
-		packet, sizeof(packet), NULL, 0
-	);
-	
-	if (error) {
-		dev_dbg(device, "synchronous set_led function failed!");
-	}
+	memcpy(buffer, packet, sizeof(packet));
+	return sizeof(packet);
 }
 
-static void xpad360w_led(struct xpad360_controller *controller, u8 status) 
+static void xpad360w_decode(
+	struct xpad360_controller *controller,
+	u8 *data,
+	size_t length,
+	ktime_t timestamp)
 {
-	struct urb *urb = xpad360c_copy_urb(controller->out, GFP_ATOMIC);
-	struct device *device = &urb->dev->dev;
-	
-	xpad360w_generate_led_packet(urb->transfer_buffer, status);
-	urb->transfer_buffer_length = 3;
-
-	usb_anchor_urb(urb, &controller->out_anchor);
-
-	if (unlikely(usb_submit_urb(urb, GFP_ATOMIC) != 0)) {
-		dev_dbg(device, "usb_submit_urb() failed in set_led()!");
-	}
-}
-
-static void xpad360w_receive(struct urb* urb) {
-	struct xpad360_controller *controller = urb->context;
-	struct device *device = &urb->dev->dev;
+	struct device *device = &controller->in->dev->dev;
 	struct input_dev *inputdev = controller->inputdev;
-	u8* data = controller->in->transfer_buffer;
 	u16 header;
 
-	if (!xpad360c_check_urb(urb))
+	/* Every packet we know has a header and at least one byte after it. */
+	if (unlikely(length < 3)) {
+		dev_dbg(device, "Runt packet received: %zu bytes", length);
 		return;
+	}
 
 	header = le16_to_cpup((__le16*)&data[0]);
 	switch (header) {
@@ -107,26 +64,57 @@ static void xpad360w_receive(struct urb* urb) {
 		dev_dbg(device, "Attachment attached! We don't support any of them. );");
 		break;
 	case 0x1400:
+		if (unlikely(length < 2 + XPAD360C_INPUT_LENGTH)) {
+			dev_dbg(device, "Truncated input packet received: %zu bytes", length);
+			break;
+		}
+
+		++controller->sequence;
+
 		if (!inputdev) {
 			dev_dbg(device, "Attempted to use inputdev while NULL!");
 			break;
 		}
 
+		xpad360c_begin_frame(inputdev, timestamp);
 		input_report_abs(inputdev, ABS_HAT0X, !!(data[2] & 0x08) - !!(data[2] & 0x04));
 		input_report_abs(inputdev, ABS_HAT0Y, !!(data[2] & 0x02) - !!(data[2] & 0x01));
-		xpad360c_parse_input(inputdev, &data[2]);
+		xpad360c_parse_input(inputdev, &data[2], controller->sequence);
 		break;
 	default: 
 		dev_dbg(device, "Unknown packet received: "
 				"Header: %#.4x", header);
 		
 	}
-
-	if (unlikely(usb_submit_urb(urb, GFP_ATOMIC) != 0)) {
-		dev_dbg(device, "usb_submit_urb() failed in receive()!");
-	}
 }
 
+static const struct xpad360c_absinfo xpad360w_abs[] = {
+	XPAD360C_ABSINFO,
+	{ ABS_HAT0X, { .minimum = -1, .maximum = 1 } },
+	{ ABS_HAT0Y, { .minimum = -1, .maximum = 1 } },
+};
+
+/* The wired controller reports the D-pad as a hat. */
+static const struct xpad360c_caps xpad360w_caps = {
+	.evbit = { [0] = XPAD360C_EV_MASK },
+	.keybit = { [XPAD360C_KEY_WORD] = XPAD360C_KEY_MASK },
+	.absbit = { 
+		[XPAD360C_ABS_WORD] = 
+			XPAD360C_ABS_MASK | BIT_MASK(ABS_HAT0X) | BIT_MASK(ABS_HAT0Y) 
+	},
+	.mscbit = { [0] = XPAD360C_MSC_MASK },
+	.ffbit = { [XPAD360C_FF_WORD] = XPAD360C_FF_MASK },
+	.abs = xpad360w_abs,
+	.num_abs = ARRAY_SIZE(xpad360w_abs),
+};
+
+static const struct xpad360c_transport xpad360w_transport = {
+	.caps = &xpad360w_caps,
+	.decode = xpad360w_decode,
+	.rumble = xpad360w_rumble_packet,
+	.led = xpad360w_led_packet,
+};
+
 static void xpad360w_register_input(
 	struct xpad360_controller *controller,
 	struct usb_device *usbdev,
@@ -142,25 +130,21 @@ static void xpad360w_register_input(
 		"\tPath: %s\n",
 		name, path);
 	
-	xpad360c_allocate_inputdev(controller, usbdev, name, path);
-	inputdev = controller->inputdev;
+	inputdev = xpad360c_allocate_inputdev(controller, usbdev, name, path);
 	if (!inputdev) return;
 
 	/* TODO: Check validity, if bad, remove from feature bit. */
-	input_ff_create_memless(inputdev, controller, xpad360w_rumble);
-
-	/* Wireless specific stuff */
-	input_set_abs_params(inputdev, ABS_HAT0X, -1, 1, 0, 0);
-	input_set_abs_params(inputdev, ABS_HAT0Y, -1, 1, 0, 0);
-	__set_bit(ABS_HAT0X, inputdev->absbit); 
-	__set_bit(ABS_HAT0Y, inputdev->absbit);
+	input_ff_create_memless(inputdev, controller, xpad360c_rumble);
 
 	error = input_register_device(inputdev);
 
 	if (unlikely(error)) {
 		input_free_device(inputdev);
-		controller->inputdev = NULL;
+		return;
 	}
+
+	/* Only now can the completion report into it. */
+	controller->inputdev = inputdev;
 }
 
 static int xpad360w_probe(struct usb_interface *interface, const struct usb_device_id *id)
@@ -178,7 +162,10 @@ static int xpad360w_probe(struct usb_interface *interface, const struct usb_devi
 
 	usb_make_path(usbdev, controller->path, sizeof(controller->path));
 
-#if 1
+	/* Urbs come first, the input device can be used as soon as it's registered. */
+	error = xpad360c_probe(controller, interface, &xpad360w_transport);
+	if (error) goto fail0;
+
 	dev_dbg(&usbdev->dev, "Device Name: %s\n", xpad360w_device_names[id - xpad360w_table]);
 
 	xpad360w_register_input(
@@ -189,28 +176,22 @@ static int xpad360w_probe(struct usb_interface *interface, const struct usb_devi
 
 	if (!controller->inputdev) {
 		error = -ENOMEM;
-		goto fail0;
+		goto fail1;
 	}
-#endif
 
-#if 1
-	error = 
-	xpad360c_probe(
-		controller, 
-		interface, 
-		xpad360w_receive, 
-		xpad360c_dangerous_complete);
+	xpad360c_set_led(controller, XPAD360_LED_ON_1);
 
-	if (error) goto fail1;
+	/* Not fatal, the controller works fine without it. */
+	if (xpad360c_haptics_init(controller))
+		dev_dbg(&usbdev->dev, "Failed to create haptics device!");
 
-	xpad360w_led(controller, XPAD360_LED_ON_1);
-#endif	
+	xpad360c_debugfs_init(controller);
 
 	goto success;
 
-	
 fail1:
-	input_unregister_device(controller->inputdev);
+	xpad360c_stop_input(controller);
+	xpad360c_destroy(controller);
 fail0:
 	devm_kfree(&usbdev->dev, controller); /* Is this needed? */
 success:
@@ -223,24 +204,49 @@ static void xpad360w_disconnect(struct usb_interface *interface)
 	struct xpad360_controller *controller = usb_get_intfdata(interface);
 
 #if 1
-	usb_kill_urb(controller->in);	
+	xpad360c_stop_input(controller);
+	xpad360c_debugfs_destroy(controller);
+
+	/* Force feedback sends on controller->out, so it has to go before that does. */
+	xpad360c_destroy_inputdev(controller);
+
+	xpad360c_haptics_destroy(controller);
 	usb_kill_anchored_urbs(&controller->out_anchor);
 
 	if (usbdev->state != USB_STATE_NOTATTACHED)
-		xpad360w_led_sync(controller, XPAD360_LED_ROTATING);
+		xpad360c_set_led_sync(controller, XPAD360_LED_ROTATING);
 
 	xpad360c_destroy(controller);
 #endif
+}
 
-#if 1
-	input_unregister_device(controller->inputdev);
-#endif
+static int xpad360w_pre_reset(struct usb_interface *interface)
+{
+	struct xpad360_controller *controller = usb_get_intfdata(interface);
+
+	/* Parks the haptics and keepalive urbs along with everything else. */
+	xpad360c_suspend(controller);
+
+	return 0;
+}
+
+static int xpad360w_post_reset(struct usb_interface *interface)
+{
+	struct xpad360_controller *controller = usb_get_intfdata(interface);
+	int error = xpad360c_resume(controller);
+
+	if (!error)
+		xpad360c_set_led(controller, XPAD360_LED_ON_1);
+
+	return error;
 }
 
 static struct usb_driver xpad360w_driver = {
 	.name		= "xpad360w",
 	.probe		= xpad360w_probe,
 	.disconnect	= xpad360w_disconnect,
+	.pre_reset	= xpad360w_pre_reset,
+	.post_reset	= xpad360w_post_reset,
 	.id_table	= xpad360w_table,
 	.soft_unbind	= 1 /* Allows us to set LED properly before module unload. */
 };
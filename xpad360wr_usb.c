@@ -1,20 +1,76 @@
+#include <linux/debugfs.h>
+#include <linux/kfifo.h>
+#include <linux/power_supply.h>
+#include <linux/seq_file.h>
+
 #include "xpad360c.h"
 
 MODULE_AUTHOR("Zachary Lund <admin@computerquip.com>");
 MODULE_DESCRIPTION("Xbox 360 Wireless Adapter");
 MODULE_LICENSE("GPL");
 
+static bool autosuspend = true;
+module_param(autosuspend, bool, 0444);
+MODULE_PARM_DESC(autosuspend, "Enable autosuspend while no controller is connected (default: true)");
+
+/* The in endpoint never sends more than this. */
+#define XPAD360WR_PACKET_SIZE 32
+
+struct xpad360wr_packet {
+	ktime_t timestamp; /* When the in urb completed */
+	u32 sequence; /* Only meaningful for input reports */
+	u8 length;
+	u8 data[XPAD360WR_PACKET_SIZE];
+};
+
+/* What xpad360wr_classify() makes of a packet in the in urb completion. */
+enum xpad360wr_class {
+	XPAD360WR_CLASS_INPUT,
+	XPAD360WR_CLASS_PRESENCE,
+	XPAD360WR_CLASS_BATTERY,
+	XPAD360WR_CLASS_CHATPAD,
+	XPAD360WR_CLASS_OTHER, /* Announce, attachments and anything we don't know */
+	XPAD360WR_CLASS_NOOP, /* Known to carry nothing for us */
+	XPAD360WR_CLASS_UNCHANGED, /* Presence, battery or chatpad keys we've already seen */
+	XPAD360WR_CLASS_COUNT
+};
+
 struct xpad360wr_controller {
 	struct xpad360_controller xpad; /* Allows us to cast into an xpad360_controller */
 
 	struct mutex mutex;
 
-	struct packet_work packet_work;
+	/* Packets handed from the in urb completion to the packet work. 
+	   The work is the only consumer, producers take the lock. */
+	struct work_struct packet_work;
+	spinlock_t packets_lock;
+	DECLARE_KFIFO(packets, struct xpad360wr_packet, 16);
+
+	/* Last state seen by the completion, -1 if unknown. 
+	   Only touched from decode, under the core decode lock, and while input is stopped. */
+	s16 seen_presence;
+	s16 seen_battery;
+	s32 seen_chatpad; /* Modifiers and both keys */
+	unsigned int classes[XPAD360WR_CLASS_COUNT];
 
 	const char *name;
+	bool connected; /* Holds a runtime PM reference while set */
+
+	/* Registered while a controller is connected. 
+	   The cached values are only written by the packet work. */
+	struct power_supply *battery;
+	struct power_supply_desc battery_desc;
+	char battery_name[48];
+	char serial[24];
+	u8 battery_level; /* Raw, 0x00 (empty) to 0xFF (full) */
+
 	uint8_t num_controller; /* This can be calculated from interface. This is just for convenience. */
 };
 
+/* Flags of the 0x08 presence packet sent by the adapter.
+   0x40 is the headset, which we don't support. */
+#define XPAD360WR_PRESENCE_CONTROLLER 0x80
+
 static const char* xpad360wr_device_names[] = {
 	"Xbox 360 Wireless Adapter",
 };
@@ -26,20 +82,29 @@ static const struct usb_device_id xpad360wr_table[] = {
 
 static void xpad360wr_query_presence(struct xpad360_controller *controller)
 {
-	struct urb *urb = xpad360c_copy_urb(controller->out, GFP_ATOMIC);
-	u8 *buffer = urb->transfer_buffer;
-	
 	static const u8 packet[12] = {
 		0x08, 0x00, 0x0F, 0xC0,
 		0x00, 0x00, 0x00, 0x00,
 		0x00, 0x00, 0x00, 0x00
 	};
-	
-	memcpy(buffer, packet, sizeof(packet));
 
-	controller->out->transfer_buffer_length = 12;
-	
-	usb_submit_urb(controller->out, GFP_ATOMIC);
+	xpad360c_send(controller, packet, sizeof(packet));
+}
+
+/* Tick 0 turns the chatpad on, afterwards it wants to hear from us about once a second. */
+static size_t xpad360wr_keepalive_packet(void *buffer, unsigned int tick)
+{
+	u8 packet[12] = {
+		0x00, 0x00, 0x0C, 0x1B,
+		0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00, 0x00, 0x00
+	};
+
+	if (tick)
+		packet[3] = tick & 1 ? 0x1F : 0x1E;
+
+	memcpy(buffer, packet, sizeof(packet));
+	return sizeof(packet);
 }
 
 static void _xpad360wr_generate_led_packet(void* buffer, u8 stat, u8 test)
@@ -53,52 +118,22 @@ static void _xpad360wr_generate_led_packet(void* buffer, u8 stat, u8 test)
 	memcpy(buffer, packet, sizeof(packet));
 }
 
-void xpad360wr_led_sync(struct xpad360_controller *controller, u8 status)
+static size_t xpad360wr_led_packet(void *buffer, u8 status)
 {
-	struct usb_device *usbdev = controller->out->dev; 
-	u8 packet[10];
-
-	_xpad360wr_generate_led_packet(packet, status, 0x08);
-
-	usb_interrupt_msg(
-		usbdev,	controller->out->pipe,
-		packet, sizeof(packet), NULL, 0
-	);
-}
-
-/* We don't currently use this... as it was causing data races (I had to wrap it up in mutexes anyways...)
- * Although, perhaps later if I can find optimizations in design without issues */
-void xpad360wr_led(struct xpad360_controller *controller, enum xpad360c_led_t status)
-{
-	struct urb *urb = xpad360c_copy_urb(controller->out, GFP_ATOMIC);
-	
-	_xpad360wr_generate_led_packet(urb->transfer_buffer, status, 0x08);
-	urb->transfer_buffer_length = 10;
-
-	usb_submit_urb(urb, GFP_ATOMIC);
+	_xpad360wr_generate_led_packet(buffer, status, 0x08);
+	return 10;
 }
 
-int xpad360wr_rumble(struct input_dev *dev, void *stuff, struct ff_effect *effect)
+static size_t xpad360wr_rumble_packet(void *buffer, u8 left, u8 rite)
 {
-	struct xpad360_controller *controller = (struct xpad360_controller*)stuff;
-
-	if (effect->type == FF_RUMBLE) {
-		struct urb *urb = xpad360c_copy_urb(controller->out, GFP_ATOMIC);
-
-		u8 left = effect->u.rumble.strong_magnitude / 255;
-		u8 rite = effect->u.rumble.weak_magnitude / 255;
-
-		u8 packet[12] = {
-			0x00, 0x01, 0x0F, 0xC0, 
-			0x00, left, rite, 0x00, 
-			0x00, 0x00, 0x00, 0x00
-		};
-
-		memcpy(urb->transfer_buffer, packet, sizeof(packet)); 
-		urb->transfer_buffer_length = 12;
+	const u8 packet[12] = {
+		0x00, 0x01, 0x0F, 0xC0, 
+		0x00, left, rite, 0x00, 
+		0x00, 0x00, 0x00, 0x00
+	};
 
-		return usb_submit_urb(urb, GFP_ATOMIC);
-	} else return -1;
+	memcpy(buffer, packet, sizeof(packet)); 
+	return sizeof(packet);
 }
 
 void xpad360wr_register_input(struct xpad360wr_controller *wr_controller, struct usb_device *usbdev)
@@ -106,64 +141,201 @@ void xpad360wr_register_input(struct xpad360wr_controller *wr_controller, struct
 	struct xpad360_controller *controller = &wr_controller->xpad;
 	struct input_dev *inputdev;
 	int error = 0;
+
+	/* Already connected. Happens when presence is queried again after a reset. */
+	if (controller->inputdev)
+		return;
 	
+	inputdev =
 	xpad360c_allocate_inputdev(
 		controller, usbdev,
 		wr_controller->name,
 		controller->path);
 	
-	if (!controller->inputdev) return;
-
-	inputdev = controller->inputdev;
+	if (!inputdev) return;
 
-	/* Wireless specific stuff */
-	__set_bit(BTN_TRIGGER_HAPPY1, inputdev->keybit);
-	__set_bit(BTN_TRIGGER_HAPPY2, inputdev->keybit);
-	__set_bit(BTN_TRIGGER_HAPPY3, inputdev->keybit);
-	__set_bit(BTN_TRIGGER_HAPPY4, inputdev->keybit);
-	
-	input_ff_create_memless(inputdev, NULL, xpad360wr_rumble);
+	input_ff_create_memless(inputdev, controller, xpad360c_rumble);
 
 	error = input_register_device(inputdev);
 
 	if (unlikely(error)) {
 		input_free_device(inputdev);
-		controller->inputdev = NULL;
+		return;
 	}
+
+	controller->inputdev = inputdev;
 }
 
-void xpad360wr_process_packet_work(struct work_struct* work) 
+static enum power_supply_property xpad360wr_battery_props[] = {
+	POWER_SUPPLY_PROP_PRESENT,
+	POWER_SUPPLY_PROP_SCOPE,
+	POWER_SUPPLY_PROP_STATUS,
+	POWER_SUPPLY_PROP_CAPACITY,
+	POWER_SUPPLY_PROP_MODEL_NAME,
+	POWER_SUPPLY_PROP_SERIAL_NUMBER,
+};
+
+static int xpad360wr_battery_get_property(
+	struct power_supply *psy,
+	enum power_supply_property psp,
+	union power_supply_propval *val)
 {
-	struct packet_work *packet = (struct packet_work*)work;
-	struct xpad360wr_controller *controller = packet->urb->context;
-	struct device *device = &packet->urb->dev->dev;
-	struct input_dev *inputdev = controller->xpad.inputdev;
-	u8 *data = packet->urb->transfer_buffer;
-	size_t data_length = packet->urb->actual_length;
+	struct xpad360wr_controller *controller = power_supply_get_drvdata(psy);
+
+	switch (psp) {
+	case POWER_SUPPLY_PROP_PRESENT:
+		val->intval = 1;
+		break;
+	case POWER_SUPPLY_PROP_SCOPE:
+		val->intval = POWER_SUPPLY_SCOPE_DEVICE;
+		break;
+	case POWER_SUPPLY_PROP_STATUS:
+		/* No packet we know of says whether a charge kit is plugged in. */
+		val->intval = POWER_SUPPLY_STATUS_UNKNOWN;
+		break;
+	case POWER_SUPPLY_PROP_CAPACITY:
+		val->intval = controller->battery_level * 100 / 0xFF;
+		break;
+	case POWER_SUPPLY_PROP_MODEL_NAME:
+		val->strval = "Xbox 360 Wireless Controller";
+		break;
+	case POWER_SUPPLY_PROP_SERIAL_NUMBER:
+		val->strval = controller->serial;
+		break;
+	default:
+		return -EINVAL;
+	}
 
-	/* Event from Adapter */
-	if (data[0] == 0x08 && data_length == 2) {
-		mutex_lock(&controller->mutex);
+	return 0;
+}
 
-		switch (data[1]) {
-		case 0x00:
-			/* All flags off */
-			xpad360c_destroy_inputdev(&controller->xpad);
-			break;
+/* Must be called with the controller mutex held. */
+static void xpad360wr_register_battery(struct xpad360wr_controller *controller)
+{
+	struct device *parent = &controller->xpad.interface->dev;
+	struct power_supply_config config = { .drv_data = controller };
+	struct power_supply_desc *desc = &controller->battery_desc;
 
-		case 0xC0:
-			/* Connection + Headset flag */
-		case 0x80: {
-			xpad360wr_led(&controller->xpad, controller->num_controller + 6);
-			xpad360wr_register_input(controller, packet->urb->dev);
-			break;
+	if (controller->battery)
+		return;
+
+	snprintf(controller->battery_name, sizeof(controller->battery_name), 
+		"xpad360wr-%s-battery", dev_name(parent));
+
+	desc->name = controller->battery_name;
+	desc->type = POWER_SUPPLY_TYPE_BATTERY;
+	desc->properties = xpad360wr_battery_props;
+	desc->num_properties = ARRAY_SIZE(xpad360wr_battery_props);
+	desc->get_property = xpad360wr_battery_get_property;
+	desc->use_for_apm = 0;
+
+	controller->battery = power_supply_register(parent, desc, &config);
+
+	if (IS_ERR(controller->battery)) {
+		dev_dbg(parent, "Failed to register battery: %li\n", PTR_ERR(controller->battery));
+		controller->battery = NULL;
+	}
+}
+
+/* Must be called with the controller mutex held. */
+static void xpad360wr_destroy_battery(struct xpad360wr_controller *controller)
+{
+	if (!controller->battery)
+		return;
+
+	power_supply_unregister(controller->battery);
+	controller->battery = NULL;
+	controller->battery_level = 0;
+	controller->serial[0] = '\0';
+}
+
+/* Listeners are only bothered when the level actually changed. */
+static void xpad360wr_update_battery(struct xpad360wr_controller *controller, u8 level)
+{
+	if (level == controller->battery_level)
+		return;
+
+	controller->battery_level = level;
+
+	mutex_lock(&controller->mutex);
+	if (controller->battery)
+		power_supply_changed(controller->battery);
+	mutex_unlock(&controller->mutex);
+}
+
+/* Must be called with the controller mutex held. */
+static void xpad360wr_update_presence(
+	struct xpad360wr_controller *controller,
+	struct usb_device *usbdev,
+	u8 flags)
+{
+	struct device *device = &usbdev->dev;
+
+	if (flags & XPAD360WR_PRESENCE_CONTROLLER) {
+		/* We got the packet, so the adapter is awake already. */
+		if (!controller->connected) {
+			controller->connected = true;
+			usb_autopm_get_interface_no_resume(controller->xpad.interface);
 		}
 
-		case 0x40:
-			/* Headset flag */
-			break;
+		xpad360c_set_led(&controller->xpad, controller->num_controller + 6);
+		xpad360wr_register_input(controller, usbdev);
+		xpad360wr_register_battery(controller);
+
+		if (xpad360c_haptics_init(&controller->xpad))
+			dev_dbg(device, "Failed to create haptics device!");
+	} else if (!flags) {
+		/* All flags off */
+		xpad360c_chatpad_detach(&controller->xpad);
+
+		if (controller->xpad.inputdev)
+			xpad360c_destroy_inputdev(&controller->xpad);
+
+		xpad360wr_destroy_battery(controller);
+		xpad360c_haptics_destroy(&controller->xpad);
+
+		/* Nothing left on this slot. Let the adapter sleep if nothing else needs it. */
+		if (controller->connected) {
+			controller->connected = false;
+			usb_autopm_put_interface_async(controller->xpad.interface);
 		}
+	}
+
+	/* Anything else is the headset on its own, which is left alone. */
+}
+
+/* The description of the 0x000A attachment packet, not terminated. */
+static bool xpad360wr_is_chatpad(const char *description, int size)
+{
+	static const char name[] = "chatpad";
+	int i = 0;
+
+	for (; i + (int)sizeof(name) - 1 <= size; ++i) {
+		if (!strncasecmp(&description[i], name, sizeof(name) - 1))
+			return true;
+	}
+
+	return false;
+}
+
+static void xpad360wr_process_packet(
+	struct xpad360wr_controller *controller,
+	struct xpad360wr_packet *packet)
+{
+	u8 *data = packet->data;
+	size_t data_length = packet->length;
+	struct usb_device *usbdev = interface_to_usbdev(controller->xpad.interface);
+	struct device *device = &usbdev->dev;
+	struct input_dev *inputdev = controller->xpad.inputdev;
+
+	/* Lengths are checked exactly below, so nothing reads past the packet. */
+	if (unlikely(data_length == 0))
+		return;
 
+	/* Event from Adapter */
+	if (data[0] == 0x08 && data_length == 2) {
+		mutex_lock(&controller->mutex);
+		xpad360wr_update_presence(controller, usbdev, data[1]);
 		mutex_unlock(&controller->mutex);
 	}
 	/* Event from Controller */
@@ -171,7 +343,10 @@ void xpad360wr_process_packet_work(struct work_struct* work)
 		u16 header = le16_to_cpup((__le16*)&data[1]);
 
 		switch (header) {
-		case 0x0000: /* FIXME */
+		case 0x0000:
+			/* Battery status. Anything else in here is still a FIXME. */
+			if (data[3] == 0x13)
+				xpad360wr_update_battery(controller, data[4]);
 			break;
 			
 		case 0x0001:
@@ -187,20 +362,39 @@ void xpad360wr_process_packet_work(struct work_struct* work)
 				goto input_proc_finish;
 			}
 			
+			xpad360c_begin_frame(inputdev, packet->timestamp);
 			input_report_key(inputdev, BTN_TRIGGER_HAPPY3, data[6] & 0x01); /* D-pad up	 */
 			input_report_key(inputdev, BTN_TRIGGER_HAPPY4, data[6] & 0x02); /* D-pad down */
 			input_report_key(inputdev, BTN_TRIGGER_HAPPY1, data[6] & 0x04); /* D-pad left */
 			input_report_key(inputdev, BTN_TRIGGER_HAPPY2, data[6] & 0x08); /* D-pad right */
-			xpad360c_parse_input(inputdev, &data[6]);
+			xpad360c_parse_input(inputdev, &data[6], packet->sequence);
 			
 input_proc_finish:
 			mutex_unlock(&controller->mutex);
 
 			break;
 
+		case 0x0002:
+			/* Chatpad keys. Modifiers, then up to two keys. */
+			xpad360c_chatpad_report(&controller->xpad, &data[25]);
+			break;
+
 		case 0x000A: {
-			int size = (strchr((char*)&data[5], 0xFF) - (char*)&data[5]);
+			/* The description is terminated by 0xFF, if at all. */
+			u8 *end = memchr(&data[5], 0xFF, data_length - 5);
+			int size = end ? end - &data[5] : data_length - 5;
+
 			dev_dbg(device, "Controller has attachment! Description: %.*s\n", size, (char*)&data[5]);
+
+			mutex_lock(&controller->mutex);
+
+			/* Anything else means the chatpad, if any, was swapped out. */
+			if (!xpad360wr_is_chatpad((char*)&data[5], size))
+				xpad360c_chatpad_detach(&controller->xpad);
+			else if (controller->connected && xpad360c_chatpad_attach(&controller->xpad))
+				dev_dbg(device, "Failed to create chatpad input device!");
+
+			mutex_unlock(&controller->mutex);
 			break;
 		}
 		case 0x0009:
@@ -217,6 +411,12 @@ input_proc_finish:
 				data[7], data[8], data[9], data[10], data[11], data[12], data[13]
 			       );
 			dev_dbg(device, "Battery Status: %i\n", data[17]);
+
+			snprintf(controller->serial, sizeof(controller->serial), 
+				"%02x%02x%02x%02x%02x%02x%02x",
+				data[7], data[8], data[9], data[10], data[11], data[12], data[13]
+			       );
+			xpad360wr_update_battery(controller, data[17]);
 			break;
 		default:
 			dev_dbg(device, "Unknown packet receieved. Header was %#.8x\n", header);
@@ -239,34 +439,178 @@ input_proc_finish:
 			printk(KERN_CONT "%#x ", (unsigned int)data[i]);
 	}
 #endif
+}
 
-	xpad360c_destroy_urb(packet->urb);
+static void xpad360wr_packet_work(struct work_struct *work)
+{
+	struct xpad360wr_controller *controller = 
+		container_of(work, struct xpad360wr_controller, packet_work);
+	struct xpad360wr_packet packet;
+
+	while (kfifo_out(&controller->packets, &packet, 1))
+		xpad360wr_process_packet(controller, &packet);
 }
 
-void xpad360wr_receive(struct urb *urb)
+/* Decides from the header whether the packet work has anything to do with it. */
+static enum xpad360wr_class xpad360wr_classify(
+	struct xpad360wr_controller *controller,
+	u8 *data,
+	size_t length)
 {
-	struct xpad360wr_controller *controller = urb->context;
-	struct device *device = &urb->dev->dev;
-	
-	if (!xpad360c_check_urb(urb))
-		return;
-	
-	/* The scheduled work will clean the urb up. */
-	controller->packet_work.urb = controller->xpad.in;
-	schedule_work((struct work_struct*)&controller->packet_work);
+	if (length == 2 && data[0] == 0x08) {
+		if (data[1] == controller->seen_presence)
+			return XPAD360WR_CLASS_UNCHANGED;
+
+		/* A different controller may have a different battery. */
+		controller->seen_presence = data[1];
+		controller->seen_battery = -1;
+		controller->seen_chatpad = -1;
+		return XPAD360WR_CLASS_PRESENCE;
+	}
 
-	/* Don't wait, just create a new one and resubmit. */
-	controller->xpad.in = xpad360c_copy_urb(controller->xpad.in, GFP_ATOMIC);
-	
-	if (!controller->xpad.in) {
-		dev_err(device, "Failed to recreate the in urb!");
+	if (length != 29 || data[0] != 0x00)
+		return XPAD360WR_CLASS_OTHER;
+
+	switch (le16_to_cpup((__le16*)&data[1])) {
+	case 0x0001:
+		return XPAD360WR_CLASS_INPUT;
+	case 0x0000:
+		if (data[3] != 0x13)
+			return XPAD360WR_CLASS_NOOP;
+
+		if (data[4] == controller->seen_battery)
+			return XPAD360WR_CLASS_UNCHANGED;
+
+		controller->seen_battery = data[4];
+		return XPAD360WR_CLASS_BATTERY;
+	case 0x0002: {
+		s32 keys = data[25] | data[26] << 8 | data[27] << 16;
+
+		/* Keys or status, either way the chatpad is still there. */
+		xpad360c_keepalive_ack(&controller->xpad);
+
+		/* Anything but 0xF0 is chatpad status we don't understand. */
+		if (data[24] != 0xF0)
+			return XPAD360WR_CLASS_NOOP;
+
+		/* The chatpad repeats held keys, only changes are worth a wakeup. */
+		if (keys == controller->seen_chatpad)
+			return XPAD360WR_CLASS_UNCHANGED;
+
+		controller->seen_chatpad = keys;
+		return XPAD360WR_CLASS_CHATPAD;
+	}
+	case 0x01F8: /* FIXME */
+	case 0x02F8: /* FIXME */
+		return XPAD360WR_CLASS_NOOP;
+	default:
+		return XPAD360WR_CLASS_OTHER;
+	}
+}
+
+/* Forget what the completion has seen, so the next presence, battery and chatpad packets get through. */
+static void xpad360wr_reset_seen(struct xpad360wr_controller *controller)
+{
+	controller->seen_presence = -1;
+	controller->seen_battery = -1;
+	controller->seen_chatpad = -1;
+}
+
+/* Runs in the in urb completion. Anything that needs to sleep is handed to the packet work. */
+static void xpad360wr_decode(
+	struct xpad360_controller *xpad,
+	u8 *data,
+	size_t length,
+	ktime_t timestamp)
+{
+	struct xpad360wr_controller *controller = 
+		container_of(xpad, struct xpad360wr_controller, xpad);
+	struct xpad360wr_packet packet;
+	enum xpad360wr_class class = xpad360wr_classify(controller, data, length);
+
+	++controller->classes[class];
+
+	/* Idle controllers send these constantly. Don't wake anybody up for them. */
+	if (class == XPAD360WR_CLASS_NOOP || class == XPAD360WR_CLASS_UNCHANGED)
 		return;
+
+	packet.timestamp = timestamp;
+	packet.sequence = 0;
+	packet.length = min(length, sizeof(packet.data));
+	memcpy(packet.data, data, packet.length);
+
+	/* Numbered here so reports dropped on the way to the work leave a gap. */
+	if (class == XPAD360WR_CLASS_INPUT)
+		packet.sequence = ++xpad->sequence;
+
+	if (!kfifo_in_spinlocked(&controller->packets, &packet, 1, &controller->packets_lock)) {
+		/* The work never sees this one. Whatever it changed has to get through next time. */
+		xpad360wr_reset_seen(controller);
+		dev_dbg(&xpad->interface->dev, "Packet queue full, dropping packet!");
 	}
 
-	if (unlikely(usb_submit_urb(controller->xpad.in, GFP_ATOMIC) != 0))
-		dev_err(device, "usb_submit_urb() failed in receive()!");
+	schedule_work(&controller->packet_work);
+}
+
+static int xpad360wr_classes_show(struct seq_file *file, void *unused)
+{
+	static const char * const names[XPAD360WR_CLASS_COUNT] = {
+		[XPAD360WR_CLASS_INPUT] = "input",
+		[XPAD360WR_CLASS_PRESENCE] = "presence",
+		[XPAD360WR_CLASS_BATTERY] = "battery",
+		[XPAD360WR_CLASS_CHATPAD] = "chatpad",
+		[XPAD360WR_CLASS_OTHER] = "other",
+		[XPAD360WR_CLASS_NOOP] = "noop",
+		[XPAD360WR_CLASS_UNCHANGED] = "unchanged",
+	};
+	struct xpad360wr_controller *controller = file->private;
+	int i = 0;
+
+	for (; i < XPAD360WR_CLASS_COUNT; ++i)
+		seq_printf(file, "%s: %u\n", names[i], controller->classes[i]);
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(xpad360wr_classes);
+
+static void xpad360wr_debugfs(struct xpad360_controller *xpad, struct dentry *dir)
+{
+	struct xpad360wr_controller *controller = 
+		container_of(xpad, struct xpad360wr_controller, xpad);
+
+	debugfs_create_file("classes", 0400, dir, controller, &xpad360wr_classes_fops);
 }
 
+static const struct xpad360c_absinfo xpad360wr_abs[] = {
+	XPAD360C_ABSINFO,
+};
+
+/* The wireless controller reports the D-pad as buttons. */
+static const struct xpad360c_caps xpad360wr_caps = {
+	.evbit = { [0] = XPAD360C_EV_MASK },
+	.keybit = { 
+		[XPAD360C_KEY_WORD] = XPAD360C_KEY_MASK,
+		[BIT_WORD(BTN_TRIGGER_HAPPY1)] = 
+			BIT_MASK(BTN_TRIGGER_HAPPY1) | BIT_MASK(BTN_TRIGGER_HAPPY2) |
+			BIT_MASK(BTN_TRIGGER_HAPPY3) | BIT_MASK(BTN_TRIGGER_HAPPY4)
+	},
+	.absbit = { [XPAD360C_ABS_WORD] = XPAD360C_ABS_MASK },
+	.mscbit = { [0] = XPAD360C_MSC_MASK },
+	.ffbit = { [XPAD360C_FF_WORD] = XPAD360C_FF_MASK },
+	.abs = xpad360wr_abs,
+	.num_abs = ARRAY_SIZE(xpad360wr_abs),
+};
+
+static const struct xpad360c_transport xpad360wr_transport = {
+	.caps = &xpad360wr_caps,
+	.decode = xpad360wr_decode,
+	.rumble = xpad360wr_rumble_packet,
+	.led = xpad360wr_led_packet,
+	.keepalive = xpad360wr_keepalive_packet,
+	.query_presence = xpad360wr_query_presence,
+	.debugfs = xpad360wr_debugfs,
+};
+
 int xpad360wr_probe(struct usb_interface *interface, const struct usb_device_id *id)
 {	
 	int error = 0;
@@ -275,10 +619,16 @@ int xpad360wr_probe(struct usb_interface *interface, const struct usb_device_id
 	struct xpad360wr_controller *controller = 
 		kzalloc(sizeof(struct xpad360wr_controller), GFP_KERNEL);
 
+	if (!controller)
+		return -ENOMEM;
+
 	usb_set_intfdata(interface, controller);
 
 	mutex_init(&controller->mutex);
-	INIT_WORK((struct work_struct *)&controller->packet_work, xpad360wr_process_packet_work);
+	spin_lock_init(&controller->packets_lock);
+	INIT_KFIFO(controller->packets);
+	INIT_WORK(&controller->packet_work, xpad360wr_packet_work);
+	xpad360wr_reset_seen(controller);
 	
 	controller->num_controller = (interface->cur_altsetting->desc.bInterfaceNumber + 1) / 2;
 	controller->name = xpad360wr_device_names[id - xpad360wr_table];
@@ -293,17 +643,21 @@ int xpad360wr_probe(struct usb_interface *interface, const struct usb_device_id
 		strlcat(path, tmp, size);
 	}
 	
-	error = 
-	xpad360c_probe(
-		(struct xpad360_controller*)controller, 
-		interface,
-		xpad360wr_receive,
-		xpad360c_dangerous_complete
-	);
-
-	if (error) return error;
+	/* A controller turning on wakes the adapter up. */
+	interface->needs_remote_wakeup = 1;
+	if (autosuspend)
+		usb_enable_autosuspend(interface_to_usbdev(interface));
+
+	/* This also asks the adapter which controllers are connected. */
+	error = xpad360c_probe(&controller->xpad, interface, &xpad360wr_transport);
+
+	if (error) {
+		usb_set_intfdata(interface, NULL);
+		kfree(controller);
+		return error;
+	}
 
-	xpad360wr_query_presence(&controller->xpad);
+	xpad360c_debugfs_init(&controller->xpad);
 
 	return error;
 }
@@ -313,23 +667,99 @@ void xpad360wr_disconnect(struct usb_interface *interface)
 	struct xpad360wr_controller *controller = usb_get_intfdata(interface);
 	struct usb_device *usbdev = interface_to_usbdev(interface);
 
-	xpad360c_destroy(&controller->xpad);
-	flush_work((struct work_struct*)&controller->packet_work);
+	xpad360c_stop_input(&controller->xpad);
+	xpad360c_debugfs_destroy(&controller->xpad);
+	cancel_work_sync(&controller->packet_work);
 	
+	xpad360c_chatpad_detach(&controller->xpad);
+	xpad360wr_destroy_battery(controller);
+	xpad360c_haptics_destroy(&controller->xpad);
+
 	if (controller->xpad.inputdev) {
 		xpad360c_destroy_inputdev(&controller->xpad);
 		
 		if (usbdev->state != USB_STATE_NOTATTACHED)
-			xpad360wr_led_sync(&controller->xpad, XPAD360_LED_ROTATING);
+			xpad360c_set_led_sync(&controller->xpad, XPAD360_LED_ROTATING);
 	}
 
+	usb_kill_anchored_urbs(&controller->xpad.out_anchor);
+	xpad360c_destroy(&controller->xpad);
+
 	kfree(controller);
 }
 
+static int xpad360wr_pre_reset(struct usb_interface *interface)
+{
+	struct xpad360wr_controller *controller = usb_get_intfdata(interface);
+
+	/* Same as suspending, the packet work sends so it goes before the out urbs. */
+	xpad360c_stop_input(&controller->xpad);
+	flush_work(&controller->packet_work);
+	xpad360c_suspend(&controller->xpad);
+
+	return 0;
+}
+
+static int xpad360wr_post_reset(struct usb_interface *interface)
+{
+	struct xpad360wr_controller *controller = usb_get_intfdata(interface);
+	int error;
+
+	xpad360wr_reset_seen(controller);
+	error = xpad360c_resume(&controller->xpad);
+
+	/* The adapter forgets about its controllers on reset. Ask again. */
+	if (!error)
+		xpad360wr_query_presence(&controller->xpad);
+
+	return error;
+}
+
+static int xpad360wr_suspend(struct usb_interface *interface, pm_message_t message)
+{
+	struct xpad360wr_controller *controller = usb_get_intfdata(interface);
+
+	/* The packet work sends, so it has to be done before the out urbs are killed. */
+	xpad360c_stop_input(&controller->xpad);
+	flush_work(&controller->packet_work);
+	xpad360c_suspend(&controller->xpad);
+
+	return 0;
+}
+
+static int xpad360wr_resume(struct usb_interface *interface)
+{
+	struct xpad360wr_controller *controller = usb_get_intfdata(interface);
+
+	/* Things may have changed while we slept. */
+	xpad360wr_reset_seen(controller);
+	return xpad360c_resume(&controller->xpad);
+}
+
+static int xpad360wr_reset_resume(struct usb_interface *interface)
+{
+	struct xpad360wr_controller *controller = usb_get_intfdata(interface);
+	int error;
+
+	xpad360wr_reset_seen(controller);
+	error = xpad360c_resume(&controller->xpad);
+
+	if (!error)
+		xpad360wr_query_presence(&controller->xpad);
+
+	return error;
+}
+
 static struct usb_driver xpad360wr_driver = {
 	.name		= "xpad360wr",
 	.probe		= xpad360wr_probe,
 	.disconnect	= xpad360wr_disconnect,
+	.pre_reset	= xpad360wr_pre_reset,
+	.post_reset	= xpad360wr_post_reset,
+	.suspend	= xpad360wr_suspend,
+	.resume		= xpad360wr_resume,
+	.reset_resume	= xpad360wr_reset_resume,
+	.supports_autosuspend = 1,
 	.id_table	= xpad360wr_table,
 	.soft_unbind	= 1 /* Allows us to set LED properly before module unload. */
 };